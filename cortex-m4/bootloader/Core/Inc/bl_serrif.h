@@ -4,11 +4,26 @@
 #include "common_defines.h"
 #include "bootloader.h"
 
-typedef void (*bl_send_bytes_fn_t)(const uint8_t *data, const uint32_t size);
+typedef bool (*bl_send_bytes_fn_t)(const uint8_t *data, const uint32_t size);
+typedef bool (*bl_send_bytes_async_fn_t)(const uint8_t *data,
+					 const uint32_t size);
 typedef void (*bl_deinit_fn_t)(void);
+typedef bool (*bl_set_baudrate_fn_t)(const uint32_t baudrate);
+typedef void (*bl_set_rx_ready_fn_t)(const bool ready);
+typedef bool (*bl_rx_position_fn_t)(uint32_t *const position);
 
 typedef struct bl_serrif_t {
+	/* Blocking, false if the driver failed or timed out */
 	bl_send_bytes_fn_t wb;
+	/* Optional: starts the transfer and returns at once, the driver
+	 * reports the end through bootloader_tx_complete() */
+	bl_send_bytes_async_fn_t wb_async;
+	bl_set_baudrate_fn_t set_baudrate;
+	/* Optional, flow control: tells the host whether it may send */
+	bl_set_rx_ready_fn_t set_rx_ready;
+	/* Optional: offset the receive DMA has written up to, false while
+	 * reception is stopped. Polled every SysTick */
+	bl_rx_position_fn_t rx_position;
 } bl_serrif_t;
 
 typedef struct bl_handle {
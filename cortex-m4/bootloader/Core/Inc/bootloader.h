@@ -16,6 +16,38 @@
 #define PATCH_VERSION 3
 
 #define BOOTLOADER_RECEIVE_BUFFER_SIZE 256
+/* Power of 2, holds a few full v2 packets that a windowed host keeps in
+ * flight while a chunk is being programmed. The UART DMA writes into it
+ * directly in circular mode, so it is also the DMA length (<= 65535) */
+#define BOOTLOADER_RX_RING_SIZE 8192
+
+/* With flow control the host is paused above the high mark and resumed once
+ * the parser has drained the ring below the low mark. The DMA position is
+ * seen at least every SysTick, so up to 1 ms of bytes (500 at 5 Mbaud) may
+ * land before the pause; the margin covers that plus what a USB serial
+ * bridge still has in flight */
+#define BOOTLOADER_RX_PAUSE_MARGIN 2048U
+#define BOOTLOADER_RX_PAUSE_LEVEL \
+	(BOOTLOADER_RX_RING_SIZE - BOOTLOADER_RX_PAUSE_MARGIN)
+#define BOOTLOADER_RX_RESUME_LEVEL (BOOTLOADER_RX_RING_SIZE / 4U)
+
+/* UART rate after reset. A rate switched to by B_CMD_SET_BAUDRATE is kept
+ * only if the host confirms it at that rate within the trial window */
+#define BOOTLOADER_DEFAULT_BAUDRATE 115200U
+#define BOOTLOADER_BAUDRATE_TRIAL_MS 500U
+
+/* Quiet line time after which a partly received packet is dropped and a
+ * resend requested, programmed into the USART receiver timeout */
+#define BOOTLOADER_RX_TIMEOUT_MS 20U
+#define BOOTLOADER_RX_TIMEOUT_BITS(baudrate_) \
+	(((baudrate_) / 1000U) * BOOTLOADER_RX_TIMEOUT_MS)
+
+/* A blocking transmit gives up after twice the wire time of its 10 bit
+ * frames at the current rate, plus slack for a host holding CTS */
+#define BOOTLOADER_TX_TIMEOUT_SLACK_MS 50U
+#define BOOTLOADER_TX_TIMEOUT_MS(size_, baudrate_)  \
+	((((size_) * 20000U) / (baudrate_)) + \
+	 BOOTLOADER_TX_TIMEOUT_SLACK_MS)
 
 typedef void (*app_reset_hander_t)(void);
 
@@ -35,6 +67,13 @@ typedef struct BootloaderVersion {
 
 void bootloader_check_elapsed_time(void);
 
+/* Interrupts post signals to the main loop, one pending bit per signal */
+#define BOOTLOADER_EVENT(sig_) (1UL << ((uint32_t)(sig_) - SIGNAL_USER))
+void bootloader_post_event(const EventSignals sig);
+void bootloader_tick(void);
+void bootloader_timeout_start(const uint32_t ms);
+void bootloader_timeout_stop(void);
+
 extern uint8_t bootloader_receive_buffer[];
 void bootloader_jump_to_user_app(void);
 void run_bootloader_main_fsm(void);
@@ -46,17 +85,41 @@ void bootloader_decide(void);
 
 void bootloader_setup(const bl_handle_t *bl_handle);
 
-void bootloader_byte_received(const uint8_t byte);
-void bootloader_send_byte(const uint8_t data);
+uint8_t *bootloader_rx_storage(uint16_t *const size);
+void bootloader_rx_reset(void);
+void bootloader_rx_dma_position(const uint32_t position);
+void bootloader_rx_timeout(void);
+bool bootloader_send_byte(const uint8_t data);
 uint32_t bootloader_read_bytes(uint8_t *data, const uint32_t length);
 void bootloader_read_byte(uint8_t *const byte);
-void bootloader_send_bytes(uint8_t *data, uint16_t length);
+uint32_t bootloader_rx_span(const uint8_t **span);
+void bootloader_rx_consume(const uint32_t length);
+bool bootloader_send_bytes(uint8_t *data, uint16_t length);
 bool bootlader_is_data_available(void);
-void bootlader_send_response_packet(comms_packet_t const *packet);
-void bootlader_get_last_transmitted_packet(comms_packet_t *const packet);
+comms_packet_t *bootloader_acquire_response_slot(void);
+bool bootlader_send_response_packet(comms_packet_t const *packet);
+bool bootloader_retransmit_last_packet(void);
+void bootloader_tx_complete(void);
+bool bootloader_tx_busy(void);
+
+bool bootloader_baudrate_supported(const uint32_t baudrate);
+void bootloader_schedule_baudrate(const uint32_t baudrate);
+bool bootloader_confirm_baudrate(const uint32_t baudrate);
 
 void bootloader_read_app_version(fw_version_t *const version);
-bool bootloader_erase_shared_plus_app(void);
+bool bootloader_erase_pages(const uint32_t bank, const uint32_t page,
+			    const uint32_t nbpages);
+uint32_t bootloader_flash_crc(const uint32_t address, const uint32_t length);
+bool bootloader_erase_page_it(const uint32_t bank, const uint32_t page);
 bool bootloader_flash_double_word(uint32_t address, uint64_t data);
+bool bootloader_flash_program_start(const uint32_t address,
+				    const uint64_t *data, const uint32_t count);
+bool bootloader_flash_busy(void);
+bool bootloader_flash_wait(void);
+void bootloader_flash_irq(void);
+void bootloader_flash_stats_reset(void);
+void bootloader_flash_stats(uint32_t *const busy_us, uint32_t *const wait_us);
+void bootloader_flash_ecc_nmi(void);
+bool bootloader_flash_ecc_error_take(void);
 
 #endif // INC_BOOTLOADER_H__
\ No newline at end of file
@@ -14,8 +14,17 @@ typedef enum {
 
 } bootloader_response_type_t;
 
+/* Capability flags exchanged in the v2 B_CMD_FW_SYNC payload */
+#define FW_SYNC_FLAG_WINDOWED (1U << 0)
+#define FW_SYNC_SUPPORTED_FLAGS (FW_SYNC_FLAG_WINDOWED)
+
+/* Feature flags in the B_CMD_GET_CAPABILITIES reply */
+#define CAPABILITY_FLAG_RESUME (1U << 0)
+#define CAPABILITY_FLAG_FLOW_CONTROL (1U << 1)
+
 typedef enum bootloader_cmd_error_codes {
-	ERROR_INVALID_COMMAND = 0x11
+	ERROR_INVALID_COMMAND = 0x11,
+	ERROR_UNSUPPORTED_BAUDRATE = 0x12
 } bootloader_cmd_error_codes_t;
 
 typedef enum {
@@ -27,13 +36,37 @@ typedef enum {
 	B_CMD_FW_VERIFY_DEVICE_ID,
 	B_CMD_FW_SEND_BIN_SIZE,
 	B_CMD_FW_SEND_BIN_IN_PACKETS,
-	// B_CMD_GET_HELP = 0xB2,
-	// B_CMD_GET_CID = 0xB3,
-	// B_CMD_GET_RDP_LVL = 0xB4,
-	// B_CMD_JMP_TO_ADDR = 0xB5,
-	// B_CMD_ERASE_FLASH = 0xB6,
+	B_CMD_GET_HELP,
+	// B_CMD_GET_CID = 0xB9,
+	// B_CMD_GET_RDP_LVL = 0xBA,
+	// B_CMD_JMP_TO_ADDR = 0xBB,
+	// B_CMD_ERASE_FLASH = 0xBC,
+	B_CMD_SET_BAUDRATE = 0xBD,
+	B_CMD_GET_CAPABILITIES,
+	B_CMD_BATCH,
+	B_CMD_GET_RANGE_CRC,
 } bootloader_packet_id_t;
 
+/* B_CMD_BATCH request step [ id ][ length (LE16) ][ payload ] and reply
+ * entry [ id ][ ACK/NACK ][ length (LE16) ][ payload ] */
+#define BATCH_STEP_HEADER_SIZE (3U)
+#define BATCH_ENTRY_HEADER_SIZE (4U)
+
+/* B_CMD_GET_CAPABILITIES reply length */
+#define CAPABILITIES_LENGTH (14U)
+
+/* B_CMD_GET_RANGE_CRC request modes. RANGE_CRC_PAGES takes [ first page
+ * (LE16) ][ count (LE16) ] counted from the image start, RANGE_CRC_RANGES
+ * a list of [ image offset (LE32) ][ length (LE32) ] */
+#define RANGE_CRC_PAGES (0U)
+#define RANGE_CRC_RANGES (1U)
+#define RANGE_CRC_PAGES_HEADER_SIZE (4U)
+#define RANGE_CRC_RANGE_SIZE (8U)
+
+/* Command ids are dense from 0xB0, the handlers are looked up by offset */
+#define B_CMD_FIRST B_CMD_RETRANSMIT_LAST_PACKET_TO_CLIENT
+#define B_CMD_TABLE_SIZE (32U)
+
 typedef struct fw_update_state {
 	bool started;
 	bool cmd_seq_broken;
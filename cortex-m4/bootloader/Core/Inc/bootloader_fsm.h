@@ -7,6 +7,7 @@
 #include "bootloader_cmds.h"
 
 typedef struct bootloader_fsm bootloader_fsm_t;
+struct bootloader_cmd;
 /* typedef status_t (*bootloader_fsm_handler)(bootloader_fsm_t *me,
 					   Event const *const e) */
 struct bootloader_fsm {
@@ -15,18 +16,11 @@ struct bootloader_fsm {
 	uint8_t uart_byte;
 	EventSignals packet_status;
 };
-void bootloader_fsm_ctr(bootloader_fsm_t *me, StateHandler initial);
+void bootloader_fsm_init(bootloader_fsm_t *const me, Event const *const e);
+void bootloader_fsm_dispatch(bootloader_fsm_t *const me, Event const *const e);
 
-status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
-					 Event const *const e);
-
-status_t bootloader_fw_update_sync_request(bootloader_fsm_t *me,
-					   Event const *const e);
-
-#define FSM_TRANSIT_TO(target_) \
-	(((Fsm *)me)->state = (StateHandler)(target_), STATE_TRANSITION)
-
-#define FSM_SUPER_TRANSIT_TO(target_) \
-	(((Fsm *)me)->super_state = (StateHandler)(target_), STATE_SUPER)
+bool bootloader_fsm_run_step(struct bootloader_cmd *const handle,
+			     comms_packet_t *const packet,
+			     comms_packet_t *const response);
 
 #endif // _INC_BOOTLOADER_FSM_H__
@@ -8,13 +8,15 @@ typedef struct comm_context comm_context_t;
 
 typedef struct bootloader_fsm bootloader_fsm_t;
 
-status_t comm_state_init(bootloader_fsm_t *me, StateHandler initial);
-status_t comm_state_frame(bootloader_fsm_t *const me, Event const *const e);
-status_t comm_state_id(bootloader_fsm_t *const me, Event const *const e);
-status_t comm_state_length(bootloader_fsm_t *const me, Event const *const e);
-status_t comm_state_payload(bootloader_fsm_t *const me, Event const *const e);
-status_t comm_state_crc(bootloader_fsm_t *const me, Event const *const e);
+void comm_fsm_init(bootloader_fsm_t *const me, Event const *const e);
+void comm_fsm_dispatch(bootloader_fsm_t *const me, Event const *const e);
 
+uint32_t comm_process_bytes(bootloader_fsm_t *const me, const uint8_t *data,
+			    const uint32_t length);
+
+comms_packet_t *comm_queue_front(EventSignals *const status);
+void comm_queue_pop(void);
 comms_packet_t *comm_get_last_packet(void);
+uint8_t comm_get_rx_version(void);
 
 #endif // _INC_BL_COMMAND_PACKET_H__
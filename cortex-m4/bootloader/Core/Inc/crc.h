@@ -44,7 +44,11 @@ void MX_CRC_Init(void);
 /* USER CODE BEGIN Prototypes */
 // uint8_t crc8(uint8_t *data, uint32_t length);
 // uint32_t crc32(const uint8_t *data, const uint32_t length);
+#define STM32_CRC32_INIT (0xFFFFFFFFU)
+
 uint32_t stm32_crc32_default(const uint8_t *data, const uint32_t length);
+uint32_t stm32_crc32_accumulate(uint32_t crc, const uint8_t *data,
+				const uint32_t length);
 
 /* USER CODE END Prototypes */
 
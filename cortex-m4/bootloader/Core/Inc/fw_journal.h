@@ -0,0 +1,21 @@
+#ifndef _INC_FW_JOURNAL_H__
+#define _INC_FW_JOURNAL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FW_JOURNAL_MAC_SIZE (16U)
+
+/* A transfer is only resumed for the very same image and chunking */
+typedef struct fw_journal_key {
+	uint32_t fw_size;
+	uint32_t chunk_size;
+	uint8_t mac[FW_JOURNAL_MAC_SIZE];
+} fw_journal_key_t;
+
+bool fw_journal_start(const fw_journal_key_t *const key);
+bool fw_journal_resume(const fw_journal_key_t *const key,
+		       uint32_t *const offset);
+bool fw_journal_record(const uint32_t offset);
+
+#endif // _INC_FW_JOURNAL_H__
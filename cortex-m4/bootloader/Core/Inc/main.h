@@ -55,6 +55,7 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+void bl_uart_rx_timeout(void);
 
 /* USER CODE END EFP */
 
@@ -75,6 +76,15 @@ void Error_Handler(void);
 #define SWO_GPIO_Port GPIOB
 
 /* USER CODE BEGIN Private defines */
+#ifndef BOOTLOADER_UART_FLOW_CONTROL
+#define BOOTLOADER_UART_FLOW_CONTROL 0
+#endif
+/* USART2 flow control: CTS in hardware, RTS as a plain output that
+ * follows the receive ring buffer (low = host may send) */
+#define USART_CTS_Pin GPIO_PIN_0
+#define USART_CTS_GPIO_Port GPIOA
+#define USART_RTS_Pin GPIO_PIN_1
+#define USART_RTS_GPIO_Port GPIOA
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -2,17 +2,96 @@
 #define _INC_PACKET_CONTROLLER_H__
 
 #include "common_defines.h"
+#include "flash.h"
+
+/* Chunks the host may have in flight beyond the cumulative ACK, one bit
+ * each in the SACK bitmap of a reply */
+#define PACKET_WINDOW_SIZE (32U)
+
+/* Windowed data packets start with the image offset of their chunk */
+#define PACKET_OFFSET_HEADER_SIZE (sizeof(uint32_t))
+
+/* Largest image (shared page + app) and smallest chunk bound the bitmap */
+#define PACKET_IMAGE_MAX_SIZE (FOTA_SHARED_APP_NBPAGES * FLASH_PAGE_SIZE)
+#define PACKET_MIN_CHUNK_SIZE (sizeof(uint64_t))
+#define PACKET_BITMAP_WORDS \
+	((PACKET_IMAGE_MAX_SIZE / PACKET_MIN_CHUNK_SIZE + 31U) / 32U)
+
+#define PACKET_PAGE_DWORDS (FLASH_PAGE_SIZE / sizeof(uint64_t))
+#define PACKET_PAGE_BITMAP_WORDS ((FOTA_SHARED_APP_NBPAGES + 31U) / 32U)
+
+/* Differential flashing: a page of data is gathered and, once complete,
+ * the double words it did not get are taken from what the page at base
+ * holds now and the two compared. Flash is only read then, so a page
+ * opens while the one before is still programmed. base is 0 while no
+ * page is open */
+typedef struct packet_page {
+	uint64_t data[PACKET_PAGE_DWORDS];
+	uint32_t written[PACKET_PAGE_DWORDS / 32U];
+	uint32_t base;
+	uint16_t filled;
+} packet_page_t;
+
+typedef enum packet_admission {
+	PACKET_NEW,
+	PACKET_DUPLICATE,
+	PACKET_OUT_OF_RANGE,
+} packet_admission_t;
 
 typedef struct packet_controller {
 	uint32_t fw_size;
 	uint32_t total_packets;
+	/* Chunks received contiguously from the start, i.e. the cumulative
+	 * ACK and the next sequence number a legacy host sends */
 	uint32_t current_packet_number;
 	uint32_t current_flash_address;
+	/* One bit per chunk of the image, set once the chunk is written */
+	uint32_t received[PACKET_BITMAP_WORDS];
+	packet_page_t page;
+	/* Page programmed in the background from the FLASH interrupt, base is
+	 * 0 once it is known to be in flash */
+	packet_page_t flashing;
+	/* Pages whose flash already held the data, neither erased nor written.
+	 * A page committed more than once counts once, and not at all once
+	 * it has been programmed */
+	uint32_t pages_skipped;
+	uint32_t page_skipped[PACKET_PAGE_BITMAP_WORDS];
+	uint32_t page_programmed[PACKET_PAGE_BITMAP_WORDS];
+	uint16_t chunk_size;
+	bool windowed;
 	bool error_occured;
 } packet_controller_t;
 
-void packet_controller_init(packet_controller_t *const pcontroller,
-			    const uint32_t fw_size);
+bool packet_controller_init(packet_controller_t *const pcontroller,
+			    const uint32_t fw_size, const uint16_t chunk_size,
+			    const bool windowed);
 void packet_controller_reset(packet_controller_t *const pcontroller);
+void packet_controller_resume_at(packet_controller_t *const pcontroller,
+				 const uint32_t seq);
+
+uint32_t packet_controller_address(const packet_controller_t *const pcontroller,
+				   const uint32_t seq);
+uint16_t
+packet_controller_chunk_length(const packet_controller_t *const pcontroller,
+			       const uint32_t seq);
+bool packet_controller_offset_to_seq(
+	const packet_controller_t *const pcontroller, const uint32_t offset,
+	uint32_t *const seq);
+packet_admission_t
+packet_controller_admit(const packet_controller_t *const pcontroller,
+			const uint32_t seq);
+uint32_t
+packet_controller_sack_bitmap(const packet_controller_t *const pcontroller);
+void packet_controller_mark_received(packet_controller_t *const pcontroller,
+				     const uint32_t seq);
+bool packet_controller_is_complete(
+	const packet_controller_t *const pcontroller);
+
+bool packet_controller_write(packet_controller_t *const pcontroller,
+			     uint32_t address, const uint8_t *data,
+			     uint16_t length);
+bool packet_controller_flush(packet_controller_t *const pcontroller);
+uint32_t packet_controller_committed_offset(
+	const packet_controller_t *const pcontroller);
 
 #endif // _INC_PACKET_CONTROLLER_H__
@@ -3,10 +3,21 @@
 
 #include "common_defines.h"
 
-#define MAX_PAYLOAD_SIZE (16)
+/*
+ * v1 frames: A5 AA BB A5 | id | length (1 byte)      | payload | crc
+ * v2 frames: A5 AA BB A6 | id | length (2 bytes, LE) | payload | crc
+ * The CRC covers id, the length bytes as sent and the payload. Responses
+ * carry no preamble and use the version of the request they answer.
+ */
+#define PROTOCOL_VERSION_1 (1)
+#define PROTOCOL_VERSION_2 (2)
+
+#define MAX_PAYLOAD_SIZE_V1 (16)
+#define MAX_PAYLOAD_SIZE (2048)
 
 #define PACKET_BYTES_ID (1)
 #define PACKET_BYTES_LENGTH (1)
+#define PACKET_BYTES_LENGTH_V2 (2)
 #define PACKET_BYTES_PAYLOAD (MAX_PAYLOAD_SIZE)
 #define PACKET_BYTES_CRC (4)
 #define PACKET_LENGTH                                          \
@@ -22,14 +33,16 @@ typedef enum {
 	B_ERROR_STRING = 0xF2
 } payload_type_t;
 
-#pragma pack(push, 1)
+/* Only the fields travel, never the struct. The header is kept ahead of
+ * the payload so the payload starts double word aligned and can be read
+ * in place as uint32_t/uint64_t, firmware chunks go to flash from it. */
 typedef struct bl_command_packet {
 	uint8_t command_id;
-	uint8_t length;
-	uint8_t payload[MAX_PAYLOAD_SIZE];
+	uint8_t version;
+	uint16_t length;
 	uint32_t crc;
+	uint8_t payload[MAX_PAYLOAD_SIZE] __attribute__((aligned(8)));
 } comms_packet_t;
-#pragma pack(pop)
 
 typedef uint16_t Signal;
 
@@ -60,22 +73,184 @@ typedef enum EventSignals {
 	SIGNAL_PACKET_INVALID,
 	SIGNAL_SYNC_REQUESTED,
 	SIGNAL_TIMEOUT,
+	SIGNAL_RX_DATA, /* UART idle, RX DMA half/full transfer */
+	SIGNAL_TX_DONE, /* response DMA transfer complete */
+	SIGNAL_FLASH_DONE, /* flash end of operation */
 	/* ... */
 	SIGNAL_MAX_COUNT
 } EventSignals;
 
 typedef struct Fsm Fsm;
 
-typedef status_t (*StateHandler)(Fsm *const me, Event const *const e);
-status_t hsm_top_status(Fsm *const me, Event const *const e);
+/*
+ * States are small ids instead of handler pointers. Id 0 is the implicit
+ * top state: parent of the outermost states and the state of a machine
+ * that has not been started yet.
+ */
+typedef uint8_t StateId;
+
+#define FSM_TOP_ID ((StateId)0)
+#define FSM_ID(state_) FSM_ID_##state_
+#define FSM_ID_fsm_top FSM_TOP_ID
+
+/* Nesting levels below the top state */
+#define FSM_MAX_DEPTH (4U)
 
 struct Fsm {
-	StateHandler state;
-	StateHandler super_state;
+	StateId state;
 };
 
-void Fsm_ctor(Fsm *const me, StateHandler initial);
-void Fsm_init(Fsm *const me, Event const *const e);
-void Fsm_dispatch(Fsm *const me, Event const *const e);
+typedef status_t (*FsmCall)(Fsm *const me, const StateId state,
+			    Event const *const e);
+
+#define FSM_TRANSIT_TO_ID(target_) \
+	(((Fsm *)me)->state = (target_), STATE_TRANSITION)
+
+#define FSM_TRANSIT_TO(target_) FSM_TRANSIT_TO_ID(FSM_ID(target_))
+
+/* Optimized builds inline the state switch wherever the engine calls it.
+ * Without optimization a call through the engine's pointer is never made
+ * direct, so there it stays a plain function */
+#ifdef __OPTIMIZE__
+#define FSM_INLINE_ inline __attribute__((always_inline))
+#else
+#define FSM_INLINE_
+#endif
+
+/*
+ * A machine is an X-macro list of X(state, parent) entries, parent being
+ * fsm_top or another state of the list. Handlers return STATE_IGNORED
+ * for events their parent should see. FSM_DECLARE goes above the handlers
+ * for the ids, FSM_DEFINE below them and generates
+ *	void name_##_init(type_ *const me, Event const *const e);
+ *	void name_##_dispatch(type_ *const me, Event const *const e);
+ * Both funnel into one switch over the state id, so the handlers are
+ * called directly. The switch is inlined into dispatch, where an event
+ * the current state handles costs one branch to the handler; transitions
+ * run from a function of their own.
+ */
+#define FSM_STATE_ID_(state_, parent_) FSM_ID(state_),
+#define FSM_STATE_PARENT_(state_, parent_) [FSM_ID(state_)] = FSM_ID(parent_),
+#define FSM_STATE_CALL_(state_, parent_) \
+	case FSM_ID(state_):             \
+		return state_((void *)me, e);
+
+#define FSM_DECLARE(name_, list_)                                \
+	enum name_##_state_id {                                  \
+		name_##_top_id = FSM_TOP_ID,                     \
+		list_(FSM_STATE_ID_) name_##_state_count         \
+	};                                                       \
+	_Static_assert(name_##_state_count <= (UINT8_MAX + 1U), \
+		       #name_ " has too many states")
+
+#define FSM_DEFINE(name_, type_, list_, initial_)                          \
+	static const StateId name_##_parent[name_##_state_count] = {       \
+		list_(FSM_STATE_PARENT_)                                   \
+	};                                                                 \
+	static FSM_INLINE_ status_t                                        \
+	name_##_call(Fsm *const me, const StateId state,                   \
+		     Event const *const e)                                 \
+	{                                                                  \
+		switch (state) {                                           \
+			list_(FSM_STATE_CALL_)                             \
+		default:                                                   \
+			return STATE_IGNORED;                              \
+		}                                                          \
+	}                                                                  \
+	void name_##_init(type_ *const me, Event const *const e)           \
+	{                                                                  \
+		fsm_init_((Fsm *)me, FSM_ID(initial_), e, name_##_call,    \
+			  name_##_parent);                                 \
+	}                                                                  \
+	static __attribute__((noinline)) void                              \
+	name_##_transit(Fsm *const me, const StateId source)               \
+	{                                                                  \
+		fsm_transit_(me, source, name_##_call, name_##_parent);    \
+	}                                                                  \
+	void name_##_dispatch(type_ *const me, Event const *const e)       \
+	{                                                                  \
+		fsm_dispatch_((Fsm *)me, e, name_##_call, name_##_parent,  \
+			      name_##_transit);                            \
+	}
+
+/* True when s is outer itself or nested in it, everything is in the top */
+static inline __attribute__((always_inline)) bool
+fsm_contains_(const StateId *const parent, const StateId outer, StateId s)
+{
+	while ((s != FSM_TOP_ID) && (s != outer)) {
+		s = parent[s];
+	}
+	return s == outer;
+}
+
+/* Run the entry actions from just below outer down to the current state */
+static inline __attribute__((always_inline)) void
+fsm_enter_(Fsm *const me, const StateId outer, const FsmCall call,
+	   const StateId *const parent)
+{
+	StateId path[FSM_MAX_DEPTH];
+	uint32_t depth = 0;
+
+	for (StateId s = me->state; s != outer; s = parent[s]) {
+		assert(depth < FSM_MAX_DEPTH);
+		path[depth++] = s;
+	}
+	while (depth > 0) {
+		(void)call(me, path[--depth], &(Event const){ SIGNAL_ENTRY });
+	}
+}
+
+static inline __attribute__((always_inline)) void
+fsm_init_(Fsm *const me, const StateId initial, Event const *const e,
+	  const FsmCall call, const StateId *const parent)
+{
+	me->state = initial;
+	/* The initial state may pick another one with FSM_TRANSIT_TO */
+	(void)call(me, initial, e);
+	fsm_enter_(me, FSM_TOP_ID, call, parent);
+}
+
+/*
+ * A transition exits from the source state up to the innermost state
+ * holding both ends and enters down to the target; a self transition
+ * exits and re-enters.
+ */
+static inline __attribute__((always_inline)) void
+fsm_transit_(Fsm *const me, const StateId source, const FsmCall call,
+	     const StateId *const parent)
+{
+	StateId s;
+
+	if (source == me->state) {
+		(void)call(me, source, &(Event const){ SIGNAL_EXIT });
+		s = parent[source];
+	} else {
+		for (s = source; !fsm_contains_(parent, s, me->state);
+		     s = parent[s]) {
+			(void)call(me, s, &(Event const){ SIGNAL_EXIT });
+		}
+	}
+	fsm_enter_(me, s, call, parent);
+}
+
+/* The event goes to the current state and bubbles up while ignored */
+static inline __attribute__((always_inline)) void
+fsm_dispatch_(Fsm *const me, Event const *const e, const FsmCall call,
+	      const StateId *const parent,
+	      void (*const transit)(Fsm *const me, const StateId source))
+{
+	const StateId source = me->state;
+	StateId s = source;
+	status_t status;
+
+	do {
+		status = call(me, s, e);
+		s = parent[s];
+	} while ((status == STATE_IGNORED) && (s != FSM_TOP_ID));
+
+	if (status == STATE_TRANSITION) {
+		transit(me, source);
+	}
+}
 
 #endif // _INC_SM_COMMON_H__
@@ -22,14 +22,69 @@
 #include "bl_serrif.h"
 #include "aes.h"
 
+#include <stdatomic.h>
+
 static const bl_handle_t *handle;
 
 uint8_t bootloader_receive_buffer[BOOTLOADER_RECEIVE_BUFFER_SIZE];
 uint8_t bootloader_version[3] = { MAJOR_VERSION, MINOR_VERSION, PATCH_VERSION };
-static comms_packet_t last_sent_packet = { 0 };
+
+#define BOOTLOADER_RESPONSE_SLOTS (2)
+
+/* Responses are built in place; the last sent one stays untouched in its
+ * slot so a retransmit can resend it without a copy */
+static comms_packet_t response_slots[BOOTLOADER_RESPONSE_SLOTS] = { 0 };
+static uint8_t last_sent_slot = 0;
+
+/* A response goes out as one transfer from here; with an async writer the
+ * FSM keeps parsing and programming while it is on the wire */
+#define BOOTLOADER_TX_BUFFER_SIZE                                        \
+	(PACKET_BYTES_ID + PACKET_BYTES_LENGTH_V2 + MAX_PAYLOAD_SIZE + \
+	 PACKET_BYTES_CRC)
+static uint8_t tx_buffer[BOOTLOADER_TX_BUFFER_SIZE];
+static volatile bool tx_busy = false;
+
+/* Signals posted from interrupts and not yet taken by the main loop. Every
+ * poster sets its own bit atomically, so any interrupt priority may post */
+static atomic_uint_least32_t pending_events = 0;
+/* Ticks left of the one-shot timeout, SIGNAL_TIMEOUT once it runs out */
+static volatile uint32_t timeout_ticks = 0;
+
+static void bootloader_wait_for_event(void);
 
 static int8_t elapsed_time = 3;
 
+/* Baud rate switch: applied once the ACK has left at the old rate, then on
+ * trial until confirmed. While on trial baudrate_fallback is non zero */
+static uint32_t baudrate_current = BOOTLOADER_DEFAULT_BAUDRATE;
+static uint32_t baudrate_pending = 0U;
+static uint32_t baudrate_fallback = 0U;
+static uint32_t baudrate_trial_tick = 0U;
+
+/* Flash operation running in the background. A page erase is over at its
+ * FLASH interrupt; a program job walks a page buffer, the interrupt of one
+ * double word starting the next */
+typedef enum flash_step {
+	FLASH_STEP_NONE,
+	FLASH_STEP_DONE,
+	FLASH_STEP_FAILED,
+} flash_step_t;
+
+static struct flash_job {
+	const uint64_t *data;
+	uint32_t address;
+	uint32_t count;
+	uint32_t index;
+	uint32_t started;
+} flash_job;
+static volatile bool flash_busy = false;
+static volatile bool flash_failed = false;
+static volatile flash_step_t flash_step = FLASH_STEP_NONE;
+/* DWT cycles the controller spent on background operations, and the part
+ * of them the main loop spent waiting for it */
+static uint64_t flash_busy_cycles = 0U;
+static uint64_t flash_wait_cycles = 0U;
+
 #define FLASH_ERASED_VALUE 0xFFFFFFFFU
 
 static bool is_msp_valid(uint32_t msp_val)
@@ -143,6 +198,10 @@ static bool verify_signature(void)
 
 void bootloader_jump_to_user_app(void)
 {
+	/* Let a last response finish before the UART is torn down */
+	while (tx_busy) {
+		bootloader_wait_for_event();
+	}
 	/*
      * 1. Configure the MSP by reading the value from the base address of the application
      */
@@ -182,6 +241,12 @@ void bootloader_jump_to_user_app(void)
 }
 
 static bootloader_fsm_t bootloader_fsm = { 0 };
+/* Frames packets out of the receive ring from the UART/DMA interrupts, the
+ * bootloader fsm takes them from the packet queue in the main loop */
+static bootloader_fsm_t rx_parser = { 0 };
+static volatile bool rx_parser_stalled = false;
+
+static void bootloader_rx_parse_stalled(void);
 
 extern Event byte_received_event;
 extern Event event_packet_valid;
@@ -189,33 +254,125 @@ extern Event event_packet_invalid;
 extern Event entry_event;
 extern Event exit_event;
 extern Event init_event;
+extern Event event_timeout;
+
+static void bootloader_baudrate_fall_back(void)
+{
+	if (baudrate_fallback == 0U) {
+		return;
+	}
+	(void)handle->serrif.set_baudrate(baudrate_fallback);
+	baudrate_current = baudrate_fallback;
+	baudrate_fallback = 0U;
+}
+
+void bootloader_post_event(const EventSignals sig)
+{
+	atomic_fetch_or_explicit(&pending_events, BOOTLOADER_EVENT(sig),
+				 memory_order_release);
+}
+
+static uint32_t bootloader_take_events(void)
+{
+	return atomic_exchange_explicit(&pending_events, 0U,
+					memory_order_acquire);
+}
+
+/* Sleeps until the next interrupt unless a signal is already pending. An
+ * interrupt pended while PRIMASK is set still ends the WFI, so one firing
+ * between the check and the sleep is not missed */
+static void bootloader_wait_for_event(void)
+{
+	__disable_irq();
+	if (atomic_load_explicit(&pending_events, memory_order_relaxed) ==
+	    0U) {
+		__WFI();
+	}
+	__enable_irq();
+}
+
+/* SysTick, 1 ms. Also samples the receive DMA, whose own events only come
+ * at idle line and every half ring */
+void bootloader_tick(void)
+{
+	uint32_t ticks = timeout_ticks;
+	uint32_t position;
+
+	if ((handle != NULL) && (handle->serrif.rx_position != NULL) &&
+	    handle->serrif.rx_position(&position)) {
+		bootloader_rx_dma_position(position);
+	}
+	if (ticks > 0U) {
+		timeout_ticks = ticks - 1U;
+		if (ticks == 1U) {
+			bootloader_post_event(SIGNAL_TIMEOUT);
+		}
+	}
+}
+
+void bootloader_timeout_start(const uint32_t ms)
+{
+	timeout_ticks = ms;
+}
+
+void bootloader_timeout_stop(void)
+{
+	timeout_ticks = 0U;
+}
+
+static void bootloader_check_baudrate_trial(void)
+{
+	if ((baudrate_fallback != 0U) &&
+	    ((HAL_GetTick() - baudrate_trial_tick) >
+	     BOOTLOADER_BAUDRATE_TRIAL_MS)) {
+		bootloader_baudrate_fall_back();
+	}
+}
 
 void run_bootloader_main_fsm(void)
 {
-	bootloader_fsm_ctr(&bootloader_fsm, (StateHandler)&comm_state_init);
-	Fsm_init((Fsm *)&bootloader_fsm, NULL);
+	bool packet_in_service = false;
+
+	bootloader_fsm_init(&bootloader_fsm, &init_event);
 
 	while (1) {
+		uint32_t events = bootloader_take_events();
+		if (events & BOOTLOADER_EVENT(SIGNAL_TIMEOUT)) {
+			bootloader_check_baudrate_trial();
+		}
+
 		switch (bootloader_fsm.packet_status) {
 		case SIGNAL_PACKET_NOT_READY: {
-			if (bootlader_is_data_available()) {
-				bootloader_read_byte(&bootloader_fsm.uart_byte);
-				Fsm_dispatch((Fsm *)&bootloader_fsm,
-					     &byte_received_event);
+			/* The fsm is back in idle, so the packet it handled
+			 * can be released to the parser */
+			if (packet_in_service) {
+				comm_queue_pop();
+				packet_in_service = false;
+			}
+			bootloader_rx_parse_stalled();
+			EventSignals status;
+			if (comm_queue_front(&status) != NULL) {
+				packet_in_service = true;
+				bootloader_fsm.packet_status = status;
+			} else {
+				/* Queued packets come with SIGNAL_RX_DATA */
+				bootloader_wait_for_event();
 			}
 
 			break;
 		}
 
 		case SIGNAL_PACKET_VALID: {
-			Fsm_dispatch((Fsm *)&bootloader_fsm,
-				     &event_packet_valid);
+			bootloader_fsm_dispatch(&bootloader_fsm,
+						&event_packet_valid);
 			break;
 		}
 
 		case SIGNAL_PACKET_INVALID: {
-			Fsm_dispatch((Fsm *)&bootloader_fsm,
-				     &event_packet_invalid);
+			/* A new rate that garbles the first packet is dropped */
+			bootloader_baudrate_fall_back();
+			bootloader_fsm_dispatch(&bootloader_fsm,
+						&event_packet_invalid);
 			break;
 		}
 
@@ -229,7 +386,7 @@ void run_bootloader_main_fsm(void)
 void bootloader_decide(void)
 {
 	while (elapsed_time > 0) {
-		HAL_Delay(1);
+		__WFI();
 	}
 
 	if (HAL_GPIO_ReadPin(B1_GPIO_Port, B1_Pin) == GPIO_PIN_RESET) {
@@ -251,34 +408,40 @@ bool bootloader_verify_crc(comms_packet_t *packet)
 	return false;
 }
 
+/* Encode [ command_id ][ length ] as it goes on the wire: one length byte
+ * for v1, two little-endian bytes for v2. Returns the header size. */
+static uint8_t bootloader_packet_header(const comms_packet_t *const packet,
+					uint8_t header[PACKET_BYTES_ID +
+						       PACKET_BYTES_LENGTH_V2])
+{
+	header[0] = packet->command_id;
+	header[1] = (uint8_t)(packet->length & 0xFFU);
+	if (packet->version == PROTOCOL_VERSION_2) {
+		header[2] = (uint8_t)(packet->length >> 8);
+		return PACKET_BYTES_ID + PACKET_BYTES_LENGTH_V2;
+	}
+	return PACKET_BYTES_ID + PACKET_BYTES_LENGTH;
+}
+
 uint32_t bootloader_compute_crc(const comms_packet_t *const packet)
 {
 	if (packet == NULL) {
 		return 0;
 	}
 
-	/* Prepare a small stack buffer containing only fields covered by CRC:
-     * [ command_id ][ length ][ payload (only if length>0) ]
-     */
-	uint8_t buf[2 + MAX_PAYLOAD_SIZE];
-	uint32_t idx = 0;
-
-	/* command_id */
-	buf[idx++] = packet->command_id;
-
-	/* length */
-	buf[idx++] = packet->length;
+	/* CRC covers [ command_id ][ length ][ payload (only if length>0) ],
+	 * accumulated field by field without a bounce buffer */
+	uint8_t header[PACKET_BYTES_ID + PACKET_BYTES_LENGTH_V2];
+	uint8_t header_size = bootloader_packet_header(packet, header);
+	uint32_t crc =
+		stm32_crc32_accumulate(STM32_CRC32_INIT, header, header_size);
 
 	/* payload only when length > 0 and within bounds */
 	if (packet->length > 0 && packet->length <= MAX_PAYLOAD_SIZE) {
-		for (uint32_t i = 0; i < packet->length; ++i) {
-			buf[idx++] = packet->payload[i];
-		}
+		crc = stm32_crc32_accumulate(crc, packet->payload,
+					     packet->length);
 	}
-
-	/* Call your existing crc32() exactly as-is */
-	// return crc32(buf, idx);
-	return stm32_crc32_default(buf, idx);
+	return crc;
 }
 
 extern TIM_HandleTypeDef htim6;
@@ -305,28 +468,146 @@ void bootloader_check_elapsed_time(void)
 }
 
 static ring_buffer_t rb;
-static uint8_t usart_buf[BOOTLOADER_RECEIVE_BUFFER_SIZE] = { 0U };
+static uint8_t usart_buf[BOOTLOADER_RX_RING_SIZE] = { 0U };
+static volatile bool rx_paused = true;
+/* Ring offset the DMA had reached when last sampled */
+static uint32_t rx_dma_index = 0U;
+
+static void bootloader_set_rx_ready(const bool ready)
+{
+	if (handle->serrif.set_rx_ready != NULL) {
+		rx_paused = !ready;
+		handle->serrif.set_rx_ready(ready);
+	}
+}
+
+/* Interrupt context. Everything buffered is framed into the packet queue,
+ * bytes past the last complete packet stay in the ring */
+static void bootloader_rx_parse(void)
+{
+	const uint8_t *span;
+	uint32_t span_length;
+
+	rx_parser_stalled = false;
+	while ((span_length = bootloader_rx_span(&span)) > 0U) {
+		uint32_t consumed =
+			comm_process_bytes(&rx_parser, span, span_length);
+		bootloader_rx_consume(consumed);
+		if (consumed < span_length) {
+			/* Queue full, the main loop picks up from here */
+			rx_parser_stalled = true;
+			break;
+		}
+	}
+}
+
+/* Main loop, once a queue slot is free again. Interrupts are held off so
+ * the parser never runs twice at once */
+static void bootloader_rx_parse_stalled(void)
+{
+	if (rx_parser_stalled) {
+		__disable_irq();
+		bootloader_rx_parse();
+		__enable_irq();
+	}
+}
 
 void bootloader_setup(const bl_handle_t *bl_handle)
 {
-	ring_buffer_setup(&rb, usart_buf, BOOTLOADER_RECEIVE_BUFFER_SIZE);
+	/* Cycle counter for the flash overlap statistics */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0U;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	comm_fsm_init(&rx_parser, &init_event);
+	ring_buffer_setup(&rb, usart_buf, BOOTLOADER_RX_RING_SIZE);
 	handle = bl_handle;
+	bootloader_set_rx_ready(true);
+}
+
+/* The UART DMA runs circular over the ring storage, so the ring only ever
+ * has its write index moved, never a byte copied */
+uint8_t *bootloader_rx_storage(uint16_t *const size)
+{
+	*size = BOOTLOADER_RX_RING_SIZE;
+	return usart_buf;
+}
+
+/* Only when the DMA is restarted from the start of the storage, whatever
+ * was buffered is dropped with it */
+void bootloader_rx_reset(void)
+{
+	ring_buffer_reset(&rb);
+	rx_dma_index = 0U;
+}
+
+/* The DMA wrote over bytes not read yet. The ring no longer tells which
+ * bytes are whole, so all of it is dropped and a packet being framed is
+ * queued as invalid, the host resends it on the NACK */
+static void bootloader_rx_overrun(void)
+{
+	bootloader_rx_consume(ring_buffer_count(&rb));
+	if (rx_parser.fsm.state != FSM_TOP_ID) {
+		comm_fsm_dispatch(&rx_parser, &event_timeout);
+	}
+	bootloader_post_event(SIGNAL_RX_DATA);
 }
 
-void bootloader_byte_received(const uint8_t byte)
+/* Called from the idle, half and full transfer events and from SysTick
+ * with the offset the DMA has written up to. More bytes arrived since the
+ * last sample than the ring had free means an overrun; samples are at most
+ * 1 ms apart, far less than the ring takes to fill */
+void bootloader_rx_dma_position(const uint32_t position)
 {
-	ring_buffer_write(&rb, (uint8_t)byte);
+	uint32_t index = position & (BOOTLOADER_RX_RING_SIZE - 1U);
+	uint32_t arrived =
+		(index - rx_dma_index) & (BOOTLOADER_RX_RING_SIZE - 1U);
+
+	if (arrived == 0U) {
+		return;
+	}
+	rx_dma_index = index;
+	bool overrun = arrived > ring_buffer_free(&rb);
+	ring_buffer_write_index_set(&rb, index);
+	if (overrun) {
+		bootloader_rx_overrun();
+		return;
+	}
+	if (!rx_paused &&
+	    (ring_buffer_count(&rb) >= BOOTLOADER_RX_PAUSE_LEVEL)) {
+		bootloader_set_rx_ready(false);
+	}
+	bootloader_rx_parse();
+	bootloader_post_event(SIGNAL_RX_DATA);
 }
 
-void bootloader_send_byte(const uint8_t data)
+/* USART receiver timeout, the line has been quiet for
+ * BOOTLOADER_RX_TIMEOUT_MS. A packet cut short is aborted, but only once
+ * everything buffered has been parsed */
+void bootloader_rx_timeout(void)
 {
-	
-	handle->serrif.wb(&data, sizeof(uint8_t));
+	if ((rx_parser.fsm.state == FSM_TOP_ID) || rx_parser_stalled ||
+	    !ring_buffer_empty(&rb)) {
+		return;
+	}
+	comm_fsm_dispatch(&rx_parser, &event_timeout);
+	bootloader_post_event(SIGNAL_RX_DATA);
+}
+
+/* Raw writes block, but not across a response still on the wire */
+bool bootloader_send_byte(const uint8_t data)
+{
+	while (tx_busy) {
+		bootloader_wait_for_event();
+	}
+	return handle->serrif.wb(&data, sizeof(uint8_t));
 }
 
-void bootloader_send_bytes(uint8_t *data, uint16_t length)
+bool bootloader_send_bytes(uint8_t *data, uint16_t length)
 {
-	handle->serrif.wb(data, length);
+	while (tx_busy) {
+		bootloader_wait_for_event();
+	}
+	return handle->serrif.wb(data, length);
 }
 
 bool bootlader_is_data_available(void)
@@ -338,47 +619,283 @@ void bootloader_read_byte(uint8_t *const byte)
 {
 	bootloader_read_bytes(byte, 1);
 }
+static void bootloader_rx_resume_if_drained(void)
+{
+	if (rx_paused && (ring_buffer_count(&rb) <= BOOTLOADER_RX_RESUME_LEVEL)) {
+		bootloader_set_rx_ready(true);
+	}
+}
+
 uint32_t bootloader_read_bytes(uint8_t *data, const uint32_t length)
 {
-	if (length == 0) {
-		return 0;
+	uint32_t bytes_read = ring_buffer_read_bulk(&rb, data, length);
+
+	bootloader_rx_resume_if_drained();
+	return bytes_read;
+}
+
+/* Zero-copy access to the buffered bytes, the span runs up to the write
+ * index or the end of the storage, whichever comes first */
+uint32_t bootloader_rx_span(const uint8_t **span)
+{
+	return ring_buffer_readable_span(&rb, span);
+}
+
+void bootloader_rx_consume(const uint32_t length)
+{
+	ring_buffer_read_commit(&rb, length);
+	bootloader_rx_resume_if_drained();
+}
+
+comms_packet_t *bootloader_acquire_response_slot(void)
+{
+	uint8_t slot = (last_sent_slot + 1U) % BOOTLOADER_RESPONSE_SLOTS;
+	comms_packet_t *packet = &response_slots[slot];
+	packet->command_id = 0;
+	packet->length = 0;
+	packet->version = PROTOCOL_VERSION_1;
+	return packet;
+}
+
+static void bootloader_apply_pending_baudrate(void)
+{
+	uint32_t baudrate = baudrate_pending;
+	baudrate_pending = 0U;
+	if ((baudrate == 0U) || !handle->serrif.set_baudrate(baudrate)) {
+		return;
+	}
+	/* A switch during a trial still falls back to the last confirmed rate */
+	if (baudrate_fallback == 0U) {
+		baudrate_fallback = baudrate_current;
+	}
+	baudrate_current = baudrate;
+	baudrate_trial_tick = HAL_GetTick();
+	bootloader_timeout_start(BOOTLOADER_BAUDRATE_TRIAL_MS + 1U);
+}
+
+/* The response has left the UART; a requested rate switch happens only
+ * now so its ACK still goes out at the old rate */
+void bootloader_tx_complete(void)
+{
+	tx_busy = false;
+	bootloader_apply_pending_baudrate();
+	bootloader_post_event(SIGNAL_TX_DONE);
+}
+
+bool bootloader_tx_busy(void)
+{
+	return tx_busy;
+}
+
+/* False if the driver could not send it. The response stays the last one
+ * sent, so the host gets it again when it asks for a retransmit */
+static bool bootloader_transmit_packet(comms_packet_t const *packet)
+{
+	/* The buffer is reused, the previous response must be out first */
+	while (tx_busy) {
+		bootloader_wait_for_event();
+	}
+
+	uint32_t size = bootloader_packet_header(packet, tx_buffer);
+	// safety: never transmit beyond MAX_PAYLOAD_SIZE
+	uint16_t len = packet->length <= MAX_PAYLOAD_SIZE ? packet->length :
+							    MAX_PAYLOAD_SIZE;
+	memcpy(&tx_buffer[size], packet->payload, len);
+	size += len;
+	memcpy(&tx_buffer[size], &packet->crc, sizeof(packet->crc));
+	size += sizeof(packet->crc);
+
+	if (handle->serrif.wb_async != NULL) {
+		tx_busy = true;
+		if (handle->serrif.wb_async(tx_buffer, size)) {
+			return true;
+		}
+		tx_busy = false;
+	}
+	if (!handle->serrif.wb(tx_buffer, size)) {
+		/* The host never saw the ACK of a rate switch, stay put */
+		baudrate_pending = 0U;
+		return false;
+	}
+	bootloader_tx_complete();
+	return true;
+}
+
+bool bootlader_send_response_packet(comms_packet_t const *packet)
+{
+	bool sent = bootloader_transmit_packet(packet);
+
+	if ((packet >= &response_slots[0]) &&
+	    (packet < &response_slots[BOOTLOADER_RESPONSE_SLOTS])) {
+		last_sent_slot = (uint8_t)(packet - &response_slots[0]);
+	} else {
+		/* Not built in a slot, keep a copy for retransmit */
+		last_sent_slot =
+			(last_sent_slot + 1U) % BOOTLOADER_RESPONSE_SLOTS;
+		memcpy(&response_slots[last_sent_slot], packet,
+		       sizeof(comms_packet_t));
+	}
+	return sent;
+}
+
+bool bootloader_retransmit_last_packet(void)
+{
+	return bootloader_transmit_packet(&response_slots[last_sent_slot]);
+}
+
+/* USART2 runs off PCLK1 with 16x oversampling: BRR must stay >= 16 and the
+ * rounding error within 2 % */
+bool bootloader_baudrate_supported(const uint32_t baudrate)
+{
+	uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+	if ((baudrate == 0U) || (handle->serrif.set_baudrate == NULL)) {
+		return false;
+	}
+	uint32_t brr = (pclk + (baudrate / 2U)) / baudrate;
+	if ((brr < 16U) || (brr > 0xFFFFU)) {
+		return false;
 	}
-	for (uint32_t bytes_read = 0; bytes_read < length; bytes_read++) {
-		if (!ring_buffer_read(&rb, &data[bytes_read])) {
-			/* Error Handling */
-			return bytes_read;
+	uint32_t actual = pclk / brr;
+	uint32_t error = actual > baudrate ? actual - baudrate :
+					     baudrate - actual;
+	return (error * 50U) <= baudrate;
+}
+
+void bootloader_schedule_baudrate(const uint32_t baudrate)
+{
+	baudrate_pending = baudrate;
+}
+
+/* True once the host talks at the given rate: ends the trial, or the rate
+ * was already in use */
+bool bootloader_confirm_baudrate(const uint32_t baudrate)
+{
+	if (baudrate != baudrate_current) {
+		return false;
+	}
+	baudrate_fallback = 0U;
+	bootloader_timeout_stop();
+	return true;
+}
+
+/* Only flash operations started in interrupt mode end up here. HAL still
+ * holds the flash lock, the next step is started in bootloader_flash_irq */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	(void)ReturnValue;
+	flash_step = FLASH_STEP_DONE;
+}
+
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	(void)ReturnValue;
+	flash_step = FLASH_STEP_FAILED;
+}
+
+static void flash_job_end(void)
+{
+	flash_job.data = NULL;
+	flash_busy_cycles += DWT->CYCCNT - flash_job.started;
+	flash_busy = false;
+	bootloader_post_event(SIGNAL_FLASH_DONE);
+}
+
+/* Start the next double word flash does not hold yet, or end the job */
+static void flash_job_next(void)
+{
+	struct flash_job *job = &flash_job;
+
+	while (job->index < job->count) {
+		uint32_t i = job->index;
+		uint32_t address = job->address + (i * sizeof(uint64_t));
+
+		job->index = i + 1U;
+		if (*(const volatile uint64_t *)address == job->data[i]) {
+			continue;
 		}
+		if (HAL_FLASH_Program_IT(FLASH_TYPEPROGRAM_DOUBLEWORD, address,
+					 job->data[i]) == HAL_OK) {
+			return;
+		}
+		flash_failed = true;
+		break;
 	}
-	return length;
+	flash_job_end();
 }
 
-void bootlader_send_response_packet(comms_packet_t const *packet)
+/* FLASH interrupt, once HAL is done with it */
+void bootloader_flash_irq(void)
 {
-	// send command id
-	handle->serrif.wb((uint8_t *)&packet->command_id, sizeof(packet->command_id));
+	flash_step_t step = flash_step;
+
+	if (!flash_busy || (step == FLASH_STEP_NONE)) {
+		return;
+	}
+	flash_step = FLASH_STEP_NONE;
+	if ((flash_job.data == NULL) || (step == FLASH_STEP_FAILED)) {
+		flash_failed = (step == FLASH_STEP_FAILED);
+		flash_job_end();
+		return;
+	}
+	flash_job_next();
+}
 
-	// send length
-	handle->serrif.wb((uint8_t *)&packet->length, sizeof(packet->length));
+bool bootloader_flash_busy(void)
+{
+	return flash_busy;
+}
 
-	// send payload only if length > 0
-	if (packet->length > 0) {
-		// safety: never transmit beyond MAX_PAYLOAD_SIZE
-		uint8_t len = packet->length <= MAX_PAYLOAD_SIZE ?
-				      packet->length :
-				      MAX_PAYLOAD_SIZE;
+/* Sleep until the background operation is over, true if it succeeded */
+bool bootloader_flash_wait(void)
+{
+	uint32_t start = DWT->CYCCNT;
+	bool waited = flash_busy;
 
-		handle->serrif.wb((uint8_t *)packet->payload, len);
+	while (flash_busy) {
+		bootloader_wait_for_event();
 	}
+	if (waited) {
+		flash_wait_cycles += DWT->CYCCNT - start;
+	}
+	return !flash_failed;
+}
 
-	handle->serrif.wb((uint8_t *)&packet->crc, sizeof(packet->crc));
+/*
+ * Program count double words from data at address in the background and
+ * return at once; words flash already holds are skipped. data must stay
+ * untouched until bootloader_flash_wait() says the job is over.
+ */
+bool bootloader_flash_program_start(const uint32_t address,
+				    const uint64_t *data, const uint32_t count)
+{
+	if (!bootloader_flash_wait()) {
+		return false;
+	}
+	HAL_FLASH_Unlock();
+	flash_job = (struct flash_job){ .data = data,
+					.address = address,
+					.count = count,
+					.started = DWT->CYCCNT };
+	flash_step = FLASH_STEP_NONE;
+	flash_failed = false;
+	flash_busy = true;
+	flash_job_next();
+	return !flash_failed;
+}
 
-	memcpy(&last_sent_packet, packet, sizeof(comms_packet_t));
-	return;
+void bootloader_flash_stats_reset(void)
+{
+	flash_busy_cycles = 0U;
+	flash_wait_cycles = 0U;
 }
 
-void bootlader_get_last_transmitted_packet(comms_packet_t *const packet)
+/* Microseconds the flash was busy in the background and the main loop
+ * waited for it; the difference was spent on packets meanwhile */
+void bootloader_flash_stats(uint32_t *const busy_us, uint32_t *const wait_us)
 {
-	memcpy(packet, &last_sent_packet, sizeof(comms_packet_t));
+	uint32_t cycles_per_us = SystemCoreClock / 1000000U;
+	*busy_us = (uint32_t)(flash_busy_cycles / cycles_per_us);
+	*wait_us = (uint32_t)(flash_wait_cycles / cycles_per_us);
 }
 
 void bootloader_read_app_version(fw_version_t *const version)
@@ -386,15 +903,19 @@ void bootloader_read_app_version(fw_version_t *const version)
 	fota_api_get_app_version(version);
 }
 
-bool bootloader_erase_shared_plus_app(void)
+bool bootloader_erase_pages(const uint32_t bank, const uint32_t page,
+			    const uint32_t nbpages)
 {
 	uint32_t error;
 	FLASH_EraseInitTypeDef erase = { .TypeErase = FLASH_TYPEERASE_PAGES,
-					 .Banks = FOTA_SHARED_APP_BANK,
-					 .Page = FOTA_SHARED_APP_PAGE,
-					 .NbPages = FOTA_SHARED_APP_NBPAGES
+					 .Banks = bank,
+					 .Page = page,
+					 .NbPages = nbpages
 
 	};
+	/* Whatever runs in the background ends first, its outcome goes to
+	 * whoever started it */
+	(void)bootloader_flash_wait();
 	HAL_FLASH_Unlock();
 	HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_SET);
 	HAL_StatusTypeDef ret = HAL_FLASHEx_Erase(&erase, &error);
@@ -403,10 +924,63 @@ bool bootloader_erase_shared_plus_app(void)
 	return ret == HAL_OK ? true : false;
 }
 
+/* One page in interrupt mode. The main loop sleeps until the FLASH
+ * interrupt reports the end while UART DMA reception goes on */
+bool bootloader_erase_page_it(const uint32_t bank, const uint32_t page)
+{
+	FLASH_EraseInitTypeDef erase = { .TypeErase = FLASH_TYPEERASE_PAGES,
+					 .Banks = bank,
+					 .Page = page,
+					 .NbPages = 1U };
+
+	if (!bootloader_flash_wait()) {
+		return false;
+	}
+	HAL_FLASH_Unlock();
+	flash_job.started = DWT->CYCCNT;
+	flash_step = FLASH_STEP_NONE;
+	flash_failed = false;
+	flash_busy = true;
+	if (HAL_FLASHEx_Erase_IT(&erase) != HAL_OK) {
+		flash_busy = false;
+		return false;
+	}
+	return bootloader_flash_wait();
+}
+
+/* CRC-32/MPEG-2 of a flash range, complemented if a double word in it
+ * fails ECC so a torn word never matches what the host expects there */
+uint32_t bootloader_flash_crc(const uint32_t address, const uint32_t length)
+{
+	(void)bootloader_flash_ecc_error_take();
+	uint32_t crc = stm32_crc32_default((const uint8_t *)address, length);
+	return bootloader_flash_ecc_error_take() ? ~crc : crc;
+}
+
 bool bootloader_flash_double_word(uint32_t address, uint64_t data)
 {
+	(void)bootloader_flash_wait();
 	// HAL_FLASH_Unlock();
-	HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, data);
+	HAL_StatusTypeDef ret =
+		HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, data);
 	// HAL_FLASH_Lock();
-	return true;
-}
\ No newline at end of file
+	return ret == HAL_OK ? true : false;
+}
+
+/* Reading a double word whose programming was cut short by a reset raises
+ * an ECC NMI; the journal and resume code expect that, so the NMI only
+ * records it and the read is treated as garbage */
+static volatile bool flash_ecc_error = false;
+
+void bootloader_flash_ecc_nmi(void)
+{
+	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ECCD);
+	flash_ecc_error = true;
+}
+
+bool bootloader_flash_ecc_error_take(void)
+{
+	bool error = flash_ecc_error;
+	flash_ecc_error = false;
+	return error;
+}
@@ -2,8 +2,37 @@
 #include "bootloader_cmds.h"
 #include "usart.h"
 #include "packet_controller.h"
+#include "fw_journal.h"
+#include "bootloader_fsm.h"
 
 static packet_controller_t pcontroller = { 0 };
+
+/* Payload size and transfer flags agreed at B_CMD_FW_SYNC */
+static uint16_t session_max_payload = MAX_PAYLOAD_SIZE_V1;
+static uint8_t session_flags = 0;
+
+/* Largest payload both sides support, kept a multiple of the flash double
+ * word so every chunk starts aligned */
+static uint16_t negotiate_max_payload(const uint16_t proposed)
+{
+	uint16_t max_payload = proposed < MAX_PAYLOAD_SIZE ? proposed :
+							     MAX_PAYLOAD_SIZE;
+	max_payload &= (uint16_t)~(sizeof(uint64_t) - 1U);
+	return max_payload < MAX_PAYLOAD_SIZE_V1 ? MAX_PAYLOAD_SIZE_V1 :
+						   max_payload;
+}
+
+/* Firmware bytes per data packet: the whole payload, or what is left next
+ * to the offset header in windowed mode, still double word aligned */
+static uint16_t session_chunk_size(void)
+{
+	if (session_flags & FW_SYNC_FLAG_WINDOWED) {
+		return (uint16_t)((session_max_payload -
+				   PACKET_OFFSET_HEADER_SIZE) &
+				  ~(sizeof(uint64_t) - 1U));
+	}
+	return session_max_payload;
+}
 static bool
 cmd_get_bootloader_version_process(comms_packet_t *const last_received_packet,
 				   comms_packet_t *const response_packet)
@@ -46,12 +75,38 @@ cmd_synced_nack_invalid_command(comms_packet_t *const last_received_packet,
 	return true;
 }
 
+/*
+ * A v2 sync carries [ version ][ max payload (LE16) ][ flags ], the ACK
+ * answers with [ version ][ max payload ][ granted flags ][ window ]. A v1
+ * sync gets an empty ACK and keeps the 16 byte stop-and-wait packets.
+ */
 static bool cmd_fw_synced_process(comms_packet_t *const last_received_packet,
 				  comms_packet_t *const response_packet)
 {
-	(void)last_received_packet;
+	session_max_payload = MAX_PAYLOAD_SIZE_V1;
+	session_flags = 0;
 	response_packet->command_id = B_ACK;
 	response_packet->length = 0;
+
+	if ((last_received_packet->version == PROTOCOL_VERSION_2) &&
+	    (last_received_packet->length >= 3)) {
+		uint16_t proposed =
+			(uint16_t)(last_received_packet->payload[1] |
+				   (last_received_packet->payload[2] << 8));
+		session_max_payload = negotiate_max_payload(proposed);
+		if (last_received_packet->length >= 4) {
+			session_flags = last_received_packet->payload[3] &
+					FW_SYNC_SUPPORTED_FLAGS;
+		}
+
+		response_packet->payload[0] = PROTOCOL_VERSION_2;
+		response_packet->payload[1] =
+			(uint8_t)(session_max_payload & 0xFFU);
+		response_packet->payload[2] = (uint8_t)(session_max_payload >> 8);
+		response_packet->payload[3] = session_flags;
+		response_packet->payload[4] = PACKET_WINDOW_SIZE;
+		response_packet->length = 5;
+	}
 	uint32_t crc = bootloader_compute_crc(response_packet);
 	response_packet->crc = crc;
 	return true;
@@ -71,13 +126,70 @@ cmd_fw_verify_device_id_process(comms_packet_t *const last_received_packet,
 	return true;
 }
 
+/*
+ * Everything below the journaled offset is programmed, but its page and
+ * the ones after may hold chunks written ahead of it or a double word torn
+ * by the reset. The transfer picks up at the first chunk reaching into
+ * that page; the page stage erases it only if it differs, the part of the
+ * chunk on the page before is already programmed with the very same bytes.
+ */
+static void fw_resume(const uint32_t journaled, uint32_t *const resume_offset)
+{
+	if (journaled >= pcontroller.fw_size) {
+		packet_controller_resume_at(&pcontroller,
+					    pcontroller.total_packets);
+		*resume_offset = pcontroller.fw_size;
+		return;
+	}
+
+	uint32_t page_offset = journaled - (journaled % FLASH_PAGE_SIZE);
+	uint32_t seq = page_offset / pcontroller.chunk_size;
+	packet_controller_resume_at(&pcontroller, seq);
+	*resume_offset = seq * pcontroller.chunk_size;
+}
+
+/*
+ * [ size ] starts a fresh transfer. A v2 host may append the 16 byte MAC
+ * of the image, [ size ][ mac ], which journals the transfer: if the same
+ * image was cut short before, only the missing part is erased and the ACK
+ * gets [ address ][ total ][ chunk size ][ resume offset ].
+ */
 static bool
 cmd_fw_send_bin_size_process(comms_packet_t *const last_received_packet,
 			     comms_packet_t *const response_packet)
 {
 	uint32_t fwsize = *(uint32_t *)&last_received_packet->payload;
+	bool keyed = last_received_packet->length >=
+		     (sizeof(uint32_t) + FW_JOURNAL_MAC_SIZE);
+
+	bool status = packet_controller_init(
+		&pcontroller, fwsize, session_chunk_size(),
+		(session_flags & FW_SYNC_FLAG_WINDOWED) != 0U);
+	bootloader_flash_stats_reset();
+
+	fw_journal_key_t key = { .fw_size = fwsize,
+				 .chunk_size = pcontroller.chunk_size };
+	uint32_t journaled = 0U;
+	uint32_t resume_offset = 0U;
+	if (status && keyed) {
+		memcpy(key.mac, &last_received_packet->payload[sizeof(uint32_t)],
+		       FW_JOURNAL_MAC_SIZE);
+	}
+	/* Nothing is erased up front: the page stage compares each page with
+	 * flash and erases only the ones that change */
+	if (status && keyed && fw_journal_resume(&key, &journaled)) {
+		fw_resume(journaled, &resume_offset);
+	} else if (status) {
+		status = fw_journal_start(keyed ? &key : NULL);
+	}
 
-	packet_controller_init(&pcontroller, fwsize);
+	if (!status) {
+		packet_controller_reset(&pcontroller);
+		response_packet->command_id = B_NACK;
+		response_packet->length = 0;
+		response_packet->crc = bootloader_compute_crc(response_packet);
+		return false;
+	}
 
 	uint32_t *pl = (uint32_t *)&response_packet->payload;
 
@@ -86,63 +198,150 @@ cmd_fw_send_bin_size_process(comms_packet_t *const last_received_packet,
 
 	response_packet->command_id = B_ACK;
 	response_packet->length = 2 * sizeof(uint32_t);
+	if (pcontroller.windowed || keyed) {
+		pl[2] = pcontroller.chunk_size;
+		response_packet->length = 3 * sizeof(uint32_t);
+	}
+	if (keyed) {
+		pl[3] = resume_offset;
+		response_packet->length = 4 * sizeof(uint32_t);
+	}
 	response_packet->crc = bootloader_compute_crc(response_packet);
-	bootloader_erase_shared_plus_app();
 	HAL_FLASH_Unlock();
+	if (packet_controller_is_complete(&pcontroller)) {
+		HAL_FLASH_Lock();
+	}
 	return true;
 }
 
+/*
+ * Legacy hosts send chunks strictly in order and get [ next address ]
+ * [ packets received ] back. Windowed hosts prefix each chunk with its
+ * chunk aligned image offset, may send in any order and get [ offset
+ * received contiguously ][ SACK bitmap ] back, so only the holes are
+ * resent. A windowed chunk of just the offset keeps what flash holds
+ * there, for hosts that found it unchanged with B_CMD_GET_RANGE_CRC.
+ * Every chunk is written once: duplicates and offsets past the image are
+ * dropped and their reply just repeats the current state. Both replies
+ * go on with [ pages skipped ], the pages that already held their data and
+ * were left alone. A v2 reply ends with [ flash busy us ][ flash wait us ]:
+ * how long the flash programmed in the background and how much of that
+ * the bootloader had to wait, the rest overlapped with packet handling.
+ */
 static bool
 cmd_fw_send_bin_in_packets(comms_packet_t *const last_received_packet,
 			   comms_packet_t *const response_packet)
 {
-	uint8_t buffer[MAX_PAYLOAD_SIZE];
-	memset(buffer, 0xFF, MAX_PAYLOAD_SIZE);
-	memcpy(buffer, last_received_packet->payload,
-	       last_received_packet->length);
-
-	uint64_t dw1, dw2;
-	memcpy(&dw1, &buffer[0], 8);
-	memcpy(&dw2, &buffer[8], 8);
-
-	if ((pcontroller.current_packet_number < pcontroller.total_packets) &&
-	    !(pcontroller.error_occured)) {
-		bool status1 = bootloader_flash_double_word(
-			pcontroller.current_flash_address, dw1);
-		pcontroller.current_flash_address += 8;
-
-		bool status2 = bootloader_flash_double_word(
-			pcontroller.current_flash_address, dw2);
-		pcontroller.current_flash_address += 8;
+	const uint8_t *data = last_received_packet->payload;
+	uint16_t length = last_received_packet->length;
+	uint32_t seq = pcontroller.current_packet_number;
+	bool status = (pcontroller.total_packets > 0U) &&
+		      !(pcontroller.error_occured);
+	bool keep = false;
+
+	if (status && pcontroller.windowed) {
+		uint32_t offset;
+		status = (length >= PACKET_OFFSET_HEADER_SIZE);
+		if (status) {
+			offset = *(const uint32_t *)data;
+			data += PACKET_OFFSET_HEADER_SIZE;
+			length -= PACKET_OFFSET_HEADER_SIZE;
+			status = packet_controller_offset_to_seq(
+				&pcontroller, offset, &seq);
+			keep = (length == 0U);
+		}
+	}
+	status = status && (length <= pcontroller.chunk_size);
+
+	if (status &&
+	    (packet_controller_admit(&pcontroller, seq) == PACKET_NEW)) {
+		uint32_t address = packet_controller_address(&pcontroller, seq);
+		if (keep) {
+			data = (const uint8_t *)address;
+			length = packet_controller_chunk_length(&pcontroller,
+								seq);
+		}
+		status = packet_controller_write(&pcontroller, address, data,
+						 length);
+		if (status) {
+			packet_controller_mark_received(&pcontroller, seq);
+			if (packet_controller_is_complete(&pcontroller)) {
+				status = packet_controller_flush(&pcontroller);
+				HAL_FLASH_Lock();
+			}
+		}
+		if (status) {
+			(void)fw_journal_record(
+				packet_controller_committed_offset(
+					&pcontroller));
+		} else {
+			pcontroller.error_occured = true;
+		}
+	}
 
-		if (status1 && status2) {
-			pcontroller.current_packet_number += 1;
-			uint32_t *pl = (uint32_t *)&response_packet->payload;
+	if (status) {
+		uint32_t *pl = (uint32_t *)&response_packet->payload;
+		if (pcontroller.windowed) {
+			pl[0] = pcontroller.current_packet_number *
+				pcontroller.chunk_size;
+			pl[1] = packet_controller_sack_bitmap(&pcontroller);
+		} else {
 			pl[0] = pcontroller.current_flash_address;
 			pl[1] = pcontroller.current_packet_number;
-
-			response_packet->length = 2 * sizeof(uint32_t);
-			response_packet->command_id = B_ACK;
-			pcontroller.error_occured = false;
-		} else {
-			pcontroller.error_occured = true;
-			response_packet->command_id = B_NACK;
-			response_packet->length = 0;
 		}
+		pl[2] = pcontroller.pages_skipped;
+		response_packet->length = 3 * sizeof(uint32_t);
+		if (last_received_packet->version == PROTOCOL_VERSION_2) {
+			bootloader_flash_stats(&pl[3], &pl[4]);
+			response_packet->length = 5 * sizeof(uint32_t);
+		}
+		response_packet->command_id = B_ACK;
+	} else {
+		response_packet->command_id = B_NACK;
+		response_packet->length = 0;
 	}
 	response_packet->crc = bootloader_compute_crc(response_packet);
-	if (pcontroller.current_packet_number >= (pcontroller.total_packets)) {
-		HAL_FLASH_Lock();
-		packet_controller_reset(&pcontroller);
-		return false;
+	return !packet_controller_is_complete(&pcontroller);
+}
+
+/*
+ * [ baudrate ] switches the UART once the ACK has gone out at the current
+ * rate. The host then repeats the request at the new rate as confirmation;
+ * without it, or if the first packet fails CRC, the bootloader falls back
+ * within BOOTLOADER_BAUDRATE_TRIAL_MS.
+ */
+static bool cmd_set_baudrate_process(comms_packet_t *const last_received_packet,
+				     comms_packet_t *const response_packet)
+{
+	uint32_t baudrate = 0U;
+	bool status = last_received_packet->length >= sizeof(baudrate);
+	if (status) {
+		memcpy(&baudrate, last_received_packet->payload,
+		       sizeof(baudrate));
+		if (!bootloader_confirm_baudrate(baudrate)) {
+			status = bootloader_baudrate_supported(baudrate);
+			if (status) {
+				bootloader_schedule_baudrate(baudrate);
+			}
+		}
 	}
-	return true;
+
+	if (status) {
+		response_packet->command_id = B_ACK;
+		response_packet->length = sizeof(baudrate);
+		memcpy(response_packet->payload, &baudrate, sizeof(baudrate));
+	} else {
+		response_packet->command_id = B_NACK;
+		response_packet->length = 1;
+		response_packet->payload[0] = ERROR_UNSUPPORTED_BAUDRATE;
+	}
+	response_packet->crc = bootloader_compute_crc(response_packet);
+	return status;
 }
 
 bool bootloader_is_app_flash_finished(void)
 {
-	return (pcontroller.current_packet_number >=
-		(pcontroller.total_packets));
+	return packet_controller_is_complete(&pcontroller);
 }
 
 static bool cmd_get_chip_id_process(comms_packet_t *const last_received_packet,
@@ -164,7 +363,9 @@ cmd_retransmit_last_packet(comms_packet_t *const last_received_packet,
 			   comms_packet_t *const response_packet)
 {
 	(void)last_received_packet;
-	bootlader_get_last_transmitted_packet(response_packet);
+	(void)response_packet;
+	/* Resent straight from its slot, send_response stays false */
+	bootloader_retransmit_last_packet();
 	return true;
 }
 
@@ -223,12 +424,56 @@ static bootloader_cmd_t RESPONSE_SEND_CHIP_ID = {
 	.process = cmd_get_chip_id_process
 };
 
+static bootloader_cmd_t RESPONSE_SET_BAUDRATE = {
+	.send_response = true,
+	.command_id = B_CMD_SET_BAUDRATE,
+	.process = cmd_set_baudrate_process
+};
+
+static bool cmd_get_help_process(comms_packet_t *const last_received_packet,
+				 comms_packet_t *const response_packet);
+static bool
+cmd_get_capabilities_process(comms_packet_t *const last_received_packet,
+			     comms_packet_t *const response_packet);
+
+static bootloader_cmd_t RESPONSE_GET_HELP = {
+	.send_response = true,
+	.command_id = B_CMD_GET_HELP,
+	.process = cmd_get_help_process
+};
+
+static bootloader_cmd_t RESPONSE_GET_CAPABILITIES = {
+	.send_response = true,
+	.command_id = B_CMD_GET_CAPABILITIES,
+	.process = cmd_get_capabilities_process
+};
+
+static bool cmd_batch_process(comms_packet_t *const last_received_packet,
+			      comms_packet_t *const response_packet);
+
+static bootloader_cmd_t RESPONSE_BATCH = {
+	.send_response = true,
+	.command_id = B_CMD_BATCH,
+	.process = cmd_batch_process
+};
+
+static bool
+cmd_get_range_crc_process(comms_packet_t *const last_received_packet,
+			  comms_packet_t *const response_packet);
+
+static bootloader_cmd_t RESPONSE_GET_RANGE_CRC = {
+	.send_response = true,
+	.command_id = B_CMD_GET_RANGE_CRC,
+	.process = cmd_get_range_crc_process
+};
+
 static bootloader_cmd_t RESPONSE_SEND_NACK_INVALID_COMMAND = {
 	.send_response = true,
 	.process = cmd_synced_nack_invalid_command
 };
 
 static bootloader_cmd_t RESPONSE_REQUEST_CLIENT_RETRANSMIT_REQUEST = {
+	.send_response = true,
 	.command_id = B_RETRANSMIT,
 	.process = retransmit_response_handle
 };
@@ -243,56 +488,346 @@ bootloader_cmd_t *cmd_send_retransmit_last_cmd(void)
 	bootloader_cmd_t *cmd = &RESPONSE_REQUEST_CLIENT_RETRANSMIT_REQUEST;
 	return cmd;
 }
+/* Indexed by command_id - B_CMD_FIRST, empty slots are unsupported ids */
+static bootloader_cmd_t *const cmd_table[B_CMD_TABLE_SIZE] = {
+	[B_CMD_RETRANSMIT_LAST_PACKET_TO_CLIENT - B_CMD_FIRST] =
+		&CMD_RETRANSMIT_LAST_PACKET_TO_CLIENT,
+	[B_CMD_GET_BOOTLOADER_VERSION - B_CMD_FIRST] =
+		&RESPONSE_GET_BOOTLOADER_VERSION,
+	[B_CMD_GET_APP_VERSION - B_CMD_FIRST] = &RESPONSE_GET_APP_VERSION,
+	[B_CMD_GET_CHIP_ID - B_CMD_FIRST] = &RESPONSE_SEND_CHIP_ID,
+	[B_CMD_FW_SYNC - B_CMD_FIRST] = &RESPONSE_FW_SEND_SYNCED,
+	[B_CMD_FW_VERIFY_DEVICE_ID - B_CMD_FIRST] =
+		&RESPONSE_FW_SEND_VERIFY_DEVICE_ID,
+	[B_CMD_FW_SEND_BIN_SIZE - B_CMD_FIRST] = &RESPONSE_FW_SEND_BIN_SIZE,
+	[B_CMD_FW_SEND_BIN_IN_PACKETS - B_CMD_FIRST] =
+		&RESPONSE_FW_SEND_BIN_IN_PACKETS,
+	[B_CMD_GET_HELP - B_CMD_FIRST] = &RESPONSE_GET_HELP,
+	[B_CMD_SET_BAUDRATE - B_CMD_FIRST] = &RESPONSE_SET_BAUDRATE,
+	[B_CMD_GET_CAPABILITIES - B_CMD_FIRST] = &RESPONSE_GET_CAPABILITIES,
+	[B_CMD_BATCH - B_CMD_FIRST] = &RESPONSE_BATCH,
+	[B_CMD_GET_RANGE_CRC - B_CMD_FIRST] = &RESPONSE_GET_RANGE_CRC,
+};
+
 bootloader_cmd_t *get_command_handle(comms_packet_t const *const packet)
 {
-	bootloader_cmd_t *cmd;
-	switch (packet->command_id) {
-	case B_CMD_RETRANSMIT_LAST_PACKET_TO_CLIENT: {
-		cmd = &CMD_RETRANSMIT_LAST_PACKET_TO_CLIENT;
-		break;
+	uint8_t index = (uint8_t)(packet->command_id - B_CMD_FIRST);
+
+	if ((index < B_CMD_TABLE_SIZE) && (cmd_table[index] != NULL)) {
+		return cmd_table[index];
 	}
+	return &RESPONSE_SEND_NACK_INVALID_COMMAND;
+}
 
-	case B_CMD_GET_BOOTLOADER_VERSION: {
-		cmd = &RESPONSE_GET_BOOTLOADER_VERSION;
-		break;
+/* Bit n set when command B_CMD_FIRST + n is supported */
+static uint32_t cmd_supported_bitmap(void)
+{
+	uint32_t bitmap = 0U;
+	for (uint8_t i = 0; i < B_CMD_TABLE_SIZE; i++) {
+		if (cmd_table[i] != NULL) {
+			bitmap |= 1UL << i;
+		}
 	}
+	return bitmap;
+}
 
-	case B_CMD_GET_APP_VERSION: {
-		cmd = &RESPONSE_GET_APP_VERSION;
-		break;
+static bool cmd_get_help_process(comms_packet_t *const last_received_packet,
+				 comms_packet_t *const response_packet)
+{
+	(void)last_received_packet;
+	uint16_t length = 0U;
+	for (uint8_t i = 0; i < B_CMD_TABLE_SIZE; i++) {
+		if (cmd_table[i] != NULL) {
+			response_packet->payload[length++] =
+				(uint8_t)(B_CMD_FIRST + i);
+		}
 	}
+	response_packet->command_id = B_ACK;
+	response_packet->length = length;
+	response_packet->crc = bootloader_compute_crc(response_packet);
+	return true;
+}
 
-	case B_CMD_GET_CHIP_ID: {
-		cmd = &RESPONSE_SEND_CHIP_ID;
-		break;
+/*
+ * [ protocol version ][ window ][ max payload (LE16) ][ max baudrate (LE32) ]
+ * [ command bitmap (LE16) ][ sync flags ][ feature flags ][ command bitmap
+ * from 0xC0 (LE16) ], so a host can pick the fastest mode before it syncs.
+ * Fits a v1 payload.
+ */
+static bool
+cmd_get_capabilities_process(comms_packet_t *const last_received_packet,
+			     comms_packet_t *const response_packet)
+{
+	(void)last_received_packet;
+	uint8_t *payload = response_packet->payload;
+	uint16_t max_payload = MAX_PAYLOAD_SIZE;
+	/* BRR of 16 at 16x oversampling */
+	uint32_t max_baudrate = HAL_RCC_GetPCLK1Freq() / 16U;
+	uint32_t commands = cmd_supported_bitmap();
+	uint16_t commands_low = (uint16_t)(commands & 0xFFFFU);
+	uint16_t commands_high = (uint16_t)(commands >> 16);
+
+	payload[0] = PROTOCOL_VERSION_2;
+	payload[1] = PACKET_WINDOW_SIZE;
+	memcpy(&payload[2], &max_payload, sizeof(max_payload));
+	memcpy(&payload[4], &max_baudrate, sizeof(max_baudrate));
+	memcpy(&payload[8], &commands_low, sizeof(commands_low));
+	payload[10] = FW_SYNC_SUPPORTED_FLAGS;
+	payload[11] = CAPABILITY_FLAG_RESUME;
+	if (BOOTLOADER_UART_FLOW_CONTROL) {
+		payload[11] |= CAPABILITY_FLAG_FLOW_CONTROL;
 	}
+	memcpy(&payload[12], &commands_high, sizeof(commands_high));
+	response_packet->command_id = B_ACK;
+	response_packet->length = CAPABILITIES_LENGTH;
+	response_packet->crc = bootloader_compute_crc(response_packet);
+	return true;
+}
 
-	case B_CMD_FW_SYNC: {
-		cmd = &RESPONSE_FW_SEND_SYNCED;
-		break;
+/*
+ * [ mode ][ ... ] hashes the image region with CRC-32/MPEG-2, the same as
+ * packets, so a host can compare it with the new image and send only what
+ * differs. RANGE_CRC_PAGES replies [ first page (LE16) ][ count (LE16) ]
+ * [ crc (LE32) ]..., the count cut to what fits the reply, and the host
+ * asks again from where it stopped; an empty request starts at page 0.
+ * RANGE_CRC_RANGES replies one crc per range. A range outside the image
+ * region NACKs the whole request.
+ */
+static bool
+cmd_get_range_crc_process(comms_packet_t *const last_received_packet,
+			  comms_packet_t *const response_packet)
+{
+	const uint8_t *in = last_received_packet->payload;
+	uint16_t in_length = last_received_packet->length;
+	uint8_t *out = response_packet->payload;
+	uint16_t limit = (last_received_packet->version == PROTOCOL_VERSION_2) ?
+				 MAX_PAYLOAD_SIZE :
+				 MAX_PAYLOAD_SIZE_V1;
+	uint8_t mode = (in_length > 0U) ? in[0] : RANGE_CRC_PAGES;
+	uint16_t out_pos = 0U;
+	bool status = true;
+
+	if (mode == RANGE_CRC_PAGES) {
+		uint16_t first = 0U;
+		uint16_t count = FOTA_SHARED_APP_NBPAGES;
+		if (in_length >= (1U + RANGE_CRC_PAGES_HEADER_SIZE)) {
+			memcpy(&first, &in[1], sizeof(first));
+			memcpy(&count, &in[3], sizeof(count));
+		}
+		status = first < FOTA_SHARED_APP_NBPAGES;
+		if (status) {
+			uint16_t fit = (uint16_t)((limit -
+						   RANGE_CRC_PAGES_HEADER_SIZE) /
+						  sizeof(uint32_t));
+			count = count < (FOTA_SHARED_APP_NBPAGES - first) ?
+					count :
+					(FOTA_SHARED_APP_NBPAGES - first);
+			count = count < fit ? count : fit;
+			memcpy(&out[0], &first, sizeof(first));
+			memcpy(&out[2], &count, sizeof(count));
+			out_pos = RANGE_CRC_PAGES_HEADER_SIZE;
+		}
+		for (uint16_t i = 0; status && (i < count); i++) {
+			uint32_t crc = bootloader_flash_crc(
+				FOTA_SHARED_START +
+					((uint32_t)(first + i) * FLASH_PAGE_SIZE),
+				FLASH_PAGE_SIZE);
+			memcpy(&out[out_pos], &crc, sizeof(crc));
+			out_pos += sizeof(crc);
+		}
+	} else if (mode == RANGE_CRC_RANGES) {
+		for (uint16_t pos = 1U;
+		     status && ((pos + RANGE_CRC_RANGE_SIZE) <= in_length);
+		     pos += RANGE_CRC_RANGE_SIZE) {
+			uint32_t offset;
+			uint32_t length;
+			memcpy(&offset, &in[pos], sizeof(offset));
+			memcpy(&length, &in[pos + 4U], sizeof(length));
+			status = (offset <= PACKET_IMAGE_MAX_SIZE) &&
+				 (length <= (PACKET_IMAGE_MAX_SIZE - offset)) &&
+				 ((out_pos + sizeof(uint32_t)) <= limit);
+			if (status) {
+				uint32_t crc = bootloader_flash_crc(
+					FOTA_SHARED_START + offset, length);
+				memcpy(&out[out_pos], &crc, sizeof(crc));
+				out_pos += sizeof(crc);
+			}
+		}
+	} else {
+		status = false;
 	}
 
-	case B_CMD_FW_VERIFY_DEVICE_ID: {
-		cmd = &RESPONSE_FW_SEND_VERIFY_DEVICE_ID;
+	response_packet->command_id = status ? B_ACK : B_NACK;
+	response_packet->length = status ? out_pos : 0U;
+	response_packet->crc = bootloader_compute_crc(response_packet);
+	return status;
+}
+
+/* Longest reply, ACK or NACK, the step can get */
+static uint32_t batch_step_reply_max(comms_packet_t const *const step)
+{
+	uint32_t length;
+
+	switch (step->command_id) {
+	case B_CMD_GET_BOOTLOADER_VERSION:
+		length = sizeof(bootloader_version);
+		break;
+	case B_CMD_GET_APP_VERSION:
+		length = sizeof(fw_version_t);
+		break;
+	case B_CMD_GET_CHIP_ID:
+		length = 2U;
+		break;
+	case B_CMD_FW_SYNC:
+		length = 5U;
+		break;
+	case B_CMD_FW_VERIFY_DEVICE_ID:
+		length = 0U;
+		break;
+	case B_CMD_FW_SEND_BIN_SIZE:
+		length = 4U * sizeof(uint32_t);
+		break;
+	case B_CMD_FW_SEND_BIN_IN_PACKETS:
+		length = 5U * sizeof(uint32_t);
+		break;
+	case B_CMD_GET_HELP:
+		length = B_CMD_TABLE_SIZE;
+		break;
+	case B_CMD_SET_BAUDRATE:
+		length = sizeof(uint32_t);
+		break;
+	case B_CMD_GET_CAPABILITIES:
+		length = CAPABILITIES_LENGTH;
+		break;
+	case B_CMD_GET_RANGE_CRC: {
+		uint32_t count = FOTA_SHARED_APP_NBPAGES;
+		uint16_t count_field;
+
+		if ((step->length > 0U) &&
+		    (step->payload[0] == RANGE_CRC_RANGES)) {
+			length = ((step->length - 1U) / RANGE_CRC_RANGE_SIZE) *
+				 sizeof(uint32_t);
+			break;
+		}
+		if (step->length >= (1U + RANGE_CRC_PAGES_HEADER_SIZE)) {
+			memcpy(&count_field, &step->payload[3],
+			       sizeof(count_field));
+			count = count_field < count ? count_field : count;
+		}
+		length = RANGE_CRC_PAGES_HEADER_SIZE +
+			 (count * sizeof(uint32_t));
 		break;
 	}
-
-	case B_CMD_FW_SEND_BIN_SIZE: {
-		cmd = &RESPONSE_FW_SEND_BIN_SIZE;
+	default:
+		/* NACK with an error code */
+		length = 1U;
 		break;
 	}
+	return length;
+}
 
-	case B_CMD_FW_SEND_BIN_IN_PACKETS: {
-		cmd = &RESPONSE_FW_SEND_BIN_IN_PACKETS;
-		break;
+/* True once the reply of the step is sure to fit room. A range CRC page
+ * request is cut to the pages that fit, its reply tells the host where to
+ * go on from */
+static bool batch_step_fit(comms_packet_t *const step, const uint16_t room)
+{
+	if ((step->command_id == B_CMD_GET_RANGE_CRC) &&
+	    ((step->length == 0U) || (step->payload[0] == RANGE_CRC_PAGES))) {
+		uint16_t first = 0U;
+		uint16_t count = FOTA_SHARED_APP_NBPAGES;
+		uint16_t fit = 0U;
+
+		if (room > RANGE_CRC_PAGES_HEADER_SIZE) {
+			fit = (uint16_t)((room - RANGE_CRC_PAGES_HEADER_SIZE) /
+					 sizeof(uint32_t));
+		}
+		if (fit == 0U) {
+			return false;
+		}
+		if (step->length >= (1U + RANGE_CRC_PAGES_HEADER_SIZE)) {
+			memcpy(&first, &step->payload[1], sizeof(first));
+			memcpy(&count, &step->payload[3], sizeof(count));
+		} else {
+			step->length = 1U + RANGE_CRC_PAGES_HEADER_SIZE;
+		}
+		count = count < fit ? count : fit;
+		step->payload[0] = RANGE_CRC_PAGES;
+		memcpy(&step->payload[1], &first, sizeof(first));
+		memcpy(&step->payload[3], &count, sizeof(count));
 	}
+	return batch_step_reply_max(step) <= room;
+}
 
-	default:
-		cmd = &RESPONSE_SEND_NACK_INVALID_COMMAND;
-		break;
+/* Each step is unpacked into a packet of its own, as if it had arrived
+ * alone */
+static comms_packet_t batch_step_packet = { 0 };
+static comms_packet_t batch_step_response = { 0 };
+
+/*
+ * Runs the steps in order through the same sequence checks as stand-alone
+ * packets and answers them all in one ACK. The batch stops after the first
+ * step that is NACKed, or before a step whose reply might not fit, so the
+ * number of entries tells the host how far it got; a step without an entry
+ * has not run. Nested batches and retransmit requests are refused as steps.
+ */
+static bool cmd_batch_process(comms_packet_t *const last_received_packet,
+			      comms_packet_t *const response_packet)
+{
+	const uint8_t *in = last_received_packet->payload;
+	uint8_t *out = response_packet->payload;
+	uint16_t limit = (last_received_packet->version == PROTOCOL_VERSION_2) ?
+				 MAX_PAYLOAD_SIZE :
+				 MAX_PAYLOAD_SIZE_V1;
+	uint16_t in_pos = 0U;
+	uint16_t out_pos = 0U;
+	bool status = true;
+
+	while (status && ((in_pos + BATCH_STEP_HEADER_SIZE) <=
+			  last_received_packet->length)) {
+		comms_packet_t *step = &batch_step_packet;
+		comms_packet_t *reply = &batch_step_response;
+		bootloader_cmd_t *handle;
+
+		step->command_id = in[in_pos];
+		step->length = (uint16_t)(in[in_pos + 1U] | (in[in_pos + 2U] << 8));
+		step->version = last_received_packet->version;
+		in_pos += BATCH_STEP_HEADER_SIZE;
+		if (step->length > (last_received_packet->length - in_pos)) {
+			status = false;
+			break;
+		}
+		memcpy(step->payload, &in[in_pos], step->length);
+		in_pos += step->length;
+
+		handle = get_command_handle(step);
+		if (!handle->send_response || (handle == &RESPONSE_BATCH)) {
+			handle = &RESPONSE_SEND_NACK_INVALID_COMMAND;
+		}
+		if (((out_pos + BATCH_ENTRY_HEADER_SIZE) > limit) ||
+		    !batch_step_fit(step, (uint16_t)(limit - out_pos -
+						     BATCH_ENTRY_HEADER_SIZE))) {
+			status = false;
+			break;
+		}
+		reply->command_id = 0U;
+		reply->length = 0U;
+		reply->version = last_received_packet->version;
+		status = bootloader_fsm_run_step(handle, step, reply) &&
+			 (reply->command_id == B_ACK);
+
+		out[out_pos] = step->command_id;
+		out[out_pos + 1U] = reply->command_id;
+		out[out_pos + 2U] = (uint8_t)(reply->length & 0xFFU);
+		out[out_pos + 3U] = (uint8_t)(reply->length >> 8);
+		memcpy(&out[out_pos + BATCH_ENTRY_HEADER_SIZE], reply->payload,
+		       reply->length);
+		out_pos += BATCH_ENTRY_HEADER_SIZE + reply->length;
 	}
 
-	return cmd;
+	response_packet->command_id = B_ACK;
+	response_packet->length = out_pos;
+	response_packet->crc = bootloader_compute_crc(response_packet);
+	return status;
 }
 
 /*
@@ -9,6 +9,13 @@ extern Event entry_event;
 extern Event exit_event;
 extern Event init_event;
 
+#define BOOTLOADER_FSM_STATES(X)                 \
+	X(bootloader_fsm_idle, fsm_top)             \
+	X(bootloader_fsm_verify_packet_id, fsm_top) \
+	X(bootloader_fw_update_sync_request, fsm_top)
+
+FSM_DECLARE(bootloader_fsm, BOOTLOADER_FSM_STATES);
+
 static fw_update_state_t fwupdatestate = {
 	.started = false,
 	.next_expected_id = B_CMD_FW_SYNC,
@@ -43,29 +50,118 @@ bool set_fw_update_next_handle(const bootloader_packet_id_t id)
 	return switch_to_fsm_handler;
 }
 
-void bootloader_fsm_ctr(bootloader_fsm_t *me, StateHandler initial)
+/* An update step was handled in sequence, expect the one after it */
+static void fw_update_advance(void)
 {
-	Fsm_ctor(&me->fsm, initial);
+	bootloader_packet_id_t id;
+
+	switch (fwupdatestate.next_expected_id) {
+	case B_CMD_FW_SYNC: {
+		id = B_CMD_FW_VERIFY_DEVICE_ID;
+		break;
+	}
+
+	case B_CMD_FW_VERIFY_DEVICE_ID: {
+		id = B_CMD_FW_SEND_BIN_SIZE;
+		break;
+	}
+
+	case B_CMD_FW_SEND_BIN_SIZE: {
+		id = B_CMD_FW_SEND_BIN_IN_PACKETS;
+		break;
+	}
+
+	case B_CMD_FW_SEND_BIN_IN_PACKETS: {
+		id = bootloader_is_app_flash_finished() ?
+			     B_CMD_FW_SEND_BIN_IN_PACKETS :
+			     B_CMD_FW_SYNC;
+		break;
+	}
+
+	default: {
+		id = B_CMD_FW_SYNC;
+		break;
+	}
+	}
+	fwupdatestate.next_expected_id = id;
 }
 
-static bool bootloader_handle_packet(void)
+/*
+ * One sub-command of a B_CMD_BATCH, checked against the update sequence
+ * the same way as a stand-alone packet: an update step in order advances
+ * it, one out of order breaks it and is handled without advancing.
+ */
+bool bootloader_fsm_run_step(struct bootloader_cmd *const handle,
+			     comms_packet_t *const packet,
+			     comms_packet_t *const response)
+{
+	bool in_sequence = set_fw_update_next_handle(handle->command_id);
+	bool status;
+
+	if (!in_sequence && fwupdatestate.cmd_seq_broken) {
+		fwupdatestate.next_expected_id = B_CMD_FW_SYNC;
+		fwupdatestate.started = false;
+	}
+	status = handle->process(packet, response);
+	if (in_sequence) {
+		fwupdatestate.cmd_seq_broken = false;
+		fwupdatestate.started = true;
+		fw_update_advance();
+	}
+	return status;
+}
+
+/* Responses are framed in the protocol version of the request they answer */
+static bool bootloader_handle_packet(bootloader_cmd_t *const handle,
+				     const uint8_t version)
 {
 	bool status = false;
 	comms_packet_t *last_received_packet = comm_get_last_packet();
-	bootloader_cmd_t *handle = get_command_handle(last_received_packet);
 	if (handle != NULL) {
-		comms_packet_t response_packet = { 0 };
-		status =
-			handle->process(last_received_packet, &response_packet);
-		if (handle->send_response) {
-			bootlader_send_response_packet(&response_packet);
+		comms_packet_t *response_packet =
+			bootloader_acquire_response_slot();
+		response_packet->version = version;
+		status = handle->process(last_received_packet, response_packet);
+		if (handle->send_response &&
+		    !bootlader_send_response_packet(response_packet)) {
+			status = false;
 		}
 	}
 	return status;
 }
 
-status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
-					 Event const *const e)
+/* Waits for the main loop to hand over the next queued packet */
+static status_t bootloader_fsm_idle(bootloader_fsm_t *me, Event const *const e)
+{
+	status_t status;
+	switch (e->sig) {
+	case SIGNAL_INIT: {
+		status = STATE_HANDLED;
+		break;
+	}
+
+	case SIGNAL_ENTRY: {
+		me->packet_status = SIGNAL_PACKET_NOT_READY;
+		status = STATE_HANDLED;
+		break;
+	}
+
+	case SIGNAL_PACKET_VALID:
+	case SIGNAL_PACKET_INVALID: {
+		/* The main loop dispatches the signal again to the new state */
+		status = FSM_TRANSIT_TO(bootloader_fsm_verify_packet_id);
+		break;
+	}
+
+	default:
+		status = STATE_IGNORED;
+		break;
+	}
+	return status;
+}
+
+static status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
+						Event const *const e)
 {
 	status_t status;
 	switch (e->sig) {
@@ -94,7 +190,8 @@ status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
 				fwupdatestate.next_expected_id = B_CMD_FW_SYNC;
 				fwupdatestate.started = false;
 			}
-			bootloader_handle_packet();
+			bootloader_handle_packet(handle,
+						 last_received_packet->version);
 			// if (handle != NULL) {
 			// 	comms_packet_t response_packet = { 0 };
 			// 	handle->process(last_received_packet,
@@ -102,7 +199,7 @@ status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
 			// 	bootlader_send_response_packet(
 			// 		&response_packet);
 			// }
-			status = FSM_TRANSIT_TO(comm_state_frame);
+			status = FSM_TRANSIT_TO(bootloader_fsm_idle);
 		}
 		break;
 	}
@@ -110,13 +207,13 @@ status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
 	case SIGNAL_PACKET_INVALID: {
 		bootloader_cmd_t *handle = cmd_send_retransmit_last_cmd();
 		if (handle == NULL) {
-			status = FSM_TRANSIT_TO(comm_state_id);
+			status = FSM_TRANSIT_TO(bootloader_fsm_idle);
 		} else {
-			bootloader_handle_packet();
+			bootloader_handle_packet(handle, comm_get_rx_version());
 			// comms_packet_t response_packet = { 0 };
 			// handle->process(NULL, &response_packet);
 			// bootlader_send_response_packet(&response_packet);
-			status = FSM_TRANSIT_TO(comm_state_id);
+			status = FSM_TRANSIT_TO(bootloader_fsm_idle);
 		}
 		break;
 	}
@@ -128,15 +225,17 @@ status_t bootloader_fsm_verify_packet_id(bootloader_fsm_t *me,
 	return status;
 }
 
-status_t bootloader_fw_update_sync_request(bootloader_fsm_t *me,
-					   Event const *const e)
+static status_t bootloader_fw_update_sync_request(bootloader_fsm_t *me,
+						  Event const *const e)
 {
 	status_t status;
 	switch (e->sig) {
 	case SIGNAL_PACKET_VALID: {
-		bootloader_handle_packet();
+		comms_packet_t *last_received_packet = comm_get_last_packet();
+		bootloader_handle_packet(get_command_handle(last_received_packet),
+					 last_received_packet->version);
 		me->packet_status = SIGNAL_PACKET_NOT_READY;
-		status = FSM_TRANSIT_TO(comm_state_id);
+		status = FSM_TRANSIT_TO(bootloader_fsm_idle);
 		break;
 	}
 	case SIGNAL_ENTRY: {
@@ -146,38 +245,17 @@ status_t bootloader_fw_update_sync_request(bootloader_fsm_t *me,
 		break;
 	}
 	case SIGNAL_EXIT: {
-		bootloader_packet_id_t id;
-
-		switch (fwupdatestate.next_expected_id) {
-		case B_CMD_FW_SYNC: {
-			id = B_CMD_FW_VERIFY_DEVICE_ID;
-			break;
-		}
-
-		case B_CMD_FW_VERIFY_DEVICE_ID: {
-			id = B_CMD_FW_SEND_BIN_SIZE;
-			break;
-		}
-
-		case B_CMD_FW_SEND_BIN_SIZE: {
-			id = B_CMD_FW_SEND_BIN_IN_PACKETS;
-			break;
-		}
-
-		case B_CMD_FW_SEND_BIN_IN_PACKETS: {
-			id = bootloader_is_app_flash_finished() ?
-				     B_CMD_FW_SEND_BIN_IN_PACKETS :
-				     B_CMD_FW_SYNC;
-			break;
-		}
-
-		default: {
-			id = B_CMD_FW_SYNC;
-			break;
-		}
-		}
-		fwupdatestate.next_expected_id = id;
+		fw_update_advance();
+		status = STATE_HANDLED;
+		break;
 	}
+
+	default:
+		status = STATE_IGNORED;
+		break;
 	}
 	return status;
 }
+
+FSM_DEFINE(bootloader_fsm, bootloader_fsm_t, BOOTLOADER_FSM_STATES,
+	   bootloader_fsm_idle)
@@ -1,4 +1,3 @@
-
 /*
 State machine setup to receive command packets
 */
@@ -7,43 +6,264 @@ State machine setup to receive command packets
 #include "comms.h"
 #include "bootloader.h"
 #include "memory.h"
+#include "crc.h"
+
+#include <stdatomic.h>
+
+#define PACKET_FRAME_SIZE (4)
+
+/* Power of 2. One slot is being parsed into, the rest wait for or are in
+ * the hands of the command handlers */
+#define COMMS_PACKET_QUEUE_DEPTH (4U)
+
+static uint16_t bytes_collected_counter = 0;
+
+/* Every state after the sync word is nested in comm_state_packet, which
+ * drops the packet when the line goes quiet */
+#define COMM_STATES(X)                           \
+	X(comm_state_frame, fsm_top)             \
+	X(comm_state_packet, fsm_top)            \
+	X(comm_state_id, comm_state_packet)      \
+	X(comm_state_length, comm_state_packet)  \
+	X(comm_state_payload, comm_state_packet) \
+	X(comm_state_crc, comm_state_packet)
+
+FSM_DECLARE(comm_fsm, COMM_STATES);
+
+typedef struct comms_queue_entry {
+	comms_packet_t packet;
+	EventSignals status;
+} comms_queue_entry_t;
 
-static uint8_t bytes_collected_counter = 0;
-static comms_packet_t temp_packet = { 0 };
-static comms_packet_t last_received_packet = { 0 };
+/*
+ * Single producer, single consumer queue of complete packets. The parser
+ * (UART/DMA interrupt) writes straight into the slot at the head and
+ * publishes it by moving the head, the main loop releases the slot at the
+ * tail once its command has been handled. Indices run freely and are only
+ * stored by their owner, with release ordering, so no lock is needed.
+ */
+static comms_queue_entry_t packet_queue[COMMS_PACKET_QUEUE_DEPTH] = { 0 };
+static atomic_uint_least32_t queue_head = 0;
+static atomic_uint_least32_t queue_tail = 0;
+static comms_packet_t *rx_packet = &packet_queue[0].packet;
+
+/* CRC of the packet under construction, fed as each field is parsed */
+static uint32_t running_crc = STM32_CRC32_INIT;
 
 extern Event byte_received_event;
 extern Event entry_event;
 extern Event exit_event;
 
-status_t comm_state_init(bootloader_fsm_t *me, StateHandler initial)
+/* Last byte of the sync word selects the protocol version */
+#define PACKET_FRAME_V1_TAIL (0xA5)
+#define PACKET_FRAME_V2_TAIL (0xA6)
+
+static const uint8_t packet_frame[PACKET_FRAME_SIZE] = { 0xA5, 0xAA, 0xBB,
+							 PACKET_FRAME_V1_TAIL };
+
+/* KMP failure function of packet_frame: longest proper prefix that is also
+ * a suffix of the first i + 1 bytes. The v2 tail does not start the word,
+ * so both versions share it. */
+static const uint8_t packet_frame_fallback[PACKET_FRAME_SIZE] = { 0, 0, 0,
+								  1 };
+
+static inline bool comm_frame_byte_matches(const uint8_t matched,
+					   const uint8_t byte)
 {
-	(void)initial;
-	return FSM_TRANSIT_TO(comm_state_frame);
+	if (matched == (PACKET_FRAME_SIZE - 1)) {
+		return (byte == PACKET_FRAME_V1_TAIL) ||
+		       (byte == PACKET_FRAME_V2_TAIL);
+	}
+	return byte == packet_frame[matched];
+}
+
+static inline void comm_frame_set_version(const uint8_t tail)
+{
+	rx_packet->version = (tail == PACKET_FRAME_V2_TAIL) ?
+				     PROTOCOL_VERSION_2 :
+				     PROTOCOL_VERSION_1;
+}
+
+/* Advance the sync word matcher by one byte without losing overlapping
+ * prefixes, e.g. A5 A5 AA BB A5 still matches */
+static inline uint8_t comm_frame_advance(uint8_t matched, const uint8_t byte)
+{
+	while ((matched > 0) && !comm_frame_byte_matches(matched, byte)) {
+		matched = packet_frame_fallback[matched - 1];
+	}
+	if (comm_frame_byte_matches(matched, byte)) {
+		if (matched == (PACKET_FRAME_SIZE - 1)) {
+			comm_frame_set_version(byte);
+		}
+		matched++;
+	}
+	return matched;
+}
+
+/*
+ * Hunt for the sync word in a contiguous run. A prefix carried over from
+ * the previous run is finished byte by byte, after that memchr jumps to
+ * the next candidate first byte and the whole word is compared at once.
+ * Returns the bytes consumed, bytes_collected_counter holds the prefix
+ * matched so far (PACKET_FRAME_SIZE once the frame is found).
+ */
+static uint32_t comm_frame_scan(const uint8_t *data, const uint32_t length)
+{
+	uint32_t pos = 0;
+
+	while ((pos < length) && (bytes_collected_counter > 0) &&
+	       (bytes_collected_counter < PACKET_FRAME_SIZE)) {
+		bytes_collected_counter =
+			comm_frame_advance(bytes_collected_counter, data[pos++]);
+	}
+
+	while ((pos < length) &&
+	       (bytes_collected_counter < PACKET_FRAME_SIZE)) {
+		const uint8_t *candidate =
+			memchr(&data[pos], packet_frame[0], length - pos);
+		if (candidate == NULL) {
+			return length;
+		}
+		pos = (uint32_t)(candidate - data);
+
+		if ((length - pos) >= PACKET_FRAME_SIZE) {
+			if ((memcmp(&data[pos], packet_frame,
+				    PACKET_FRAME_SIZE - 1) == 0) &&
+			    comm_frame_byte_matches(
+				    PACKET_FRAME_SIZE - 1,
+				    data[pos + PACKET_FRAME_SIZE - 1])) {
+				comm_frame_set_version(
+					data[pos + PACKET_FRAME_SIZE - 1]);
+				bytes_collected_counter = PACKET_FRAME_SIZE;
+				pos += PACKET_FRAME_SIZE;
+			} else {
+				pos++;
+			}
+		} else {
+			/* Partial candidate at the end of the run */
+			while ((pos < length) &&
+			       (bytes_collected_counter < PACKET_FRAME_SIZE)) {
+				bytes_collected_counter = comm_frame_advance(
+					bytes_collected_counter, data[pos++]);
+			}
+		}
+	}
+	return pos;
+}
+
+/* Entry/exit actions shared by the per-byte handlers and the span parser */
+static inline void comm_frame_entry(bootloader_fsm_t *const me)
+{
+	bytes_collected_counter = 0;
+	me->packet_status = SIGNAL_PACKET_NOT_READY;
+}
+
+static inline void comm_id_entry(bootloader_fsm_t *const me)
+{
+	/* Every other field is overwritten while parsing, only the length is
+	 * assembled byte by byte */
+	bytes_collected_counter = 0;
+	rx_packet->length = 0;
+	running_crc = STM32_CRC32_INIT;
+	me->packet_status = SIGNAL_PACKET_NOT_READY;
+}
+
+static inline uint8_t comm_length_bytes(void)
+{
+	return (rx_packet->version == PROTOCOL_VERSION_2) ?
+		       PACKET_BYTES_LENGTH_V2 :
+		       PACKET_BYTES_LENGTH;
+}
+
+/* Collect one little-endian length byte, true once the field is complete */
+static inline bool comm_length_collect(const uint8_t byte)
+{
+	rx_packet->length |= (uint16_t)((uint16_t)byte
+					<< (8U * bytes_collected_counter));
+	running_crc = stm32_crc32_accumulate(running_crc, &byte, sizeof(byte));
+	bytes_collected_counter++;
+	return bytes_collected_counter >= comm_length_bytes();
+}
+
+/* State following a complete length field; v1 keeps its small limit */
+static inline StateId comm_length_next(void)
+{
+	uint16_t limit = (rx_packet->version == PROTOCOL_VERSION_2) ?
+				 MAX_PAYLOAD_SIZE :
+				 MAX_PAYLOAD_SIZE_V1;
+	if (rx_packet->length == 0) {
+		return FSM_ID(comm_state_crc);
+	}
+	if (rx_packet->length > limit) {
+		/* Corrupted length, hunt for the next frame */
+		return FSM_ID(comm_state_frame);
+	}
+	return FSM_ID(comm_state_payload);
+}
+
+static inline void comm_crc_complete(bootloader_fsm_t *const me)
+{
+	bool valid = (running_crc == rx_packet->crc);
+	me->packet_status = valid ? SIGNAL_PACKET_VALID : SIGNAL_PACKET_INVALID;
+}
+
+/* The head slot is only written while the consumer has left it free */
+static inline bool comm_queue_has_room(void)
+{
+	uint32_t head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+	return (head - tail) < COMMS_PACKET_QUEUE_DEPTH;
+}
+
+/* Invalid packets are queued too, their version picks the framing of the
+ * retransmit request */
+static inline void comm_queue_push(bootloader_fsm_t *const me)
+{
+	uint32_t head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+
+	packet_queue[head % COMMS_PACKET_QUEUE_DEPTH].status = me->packet_status;
+	atomic_store_explicit(&queue_head, head + 1U, memory_order_release);
+	rx_packet = &packet_queue[(head + 1U) % COMMS_PACKET_QUEUE_DEPTH].packet;
+	comm_frame_entry(me);
 }
 
-static const uint8_t packet_frame[4] = { 0xA5, 0xAA, 0xBB, 0xA5 };
+/* The line went quiet in the middle of a packet. What arrived is queued as
+ * invalid, so the host is asked for a resend right away instead of the
+ * next frame being eaten as the rest of this one */
+static inline status_t comm_timeout(bootloader_fsm_t *const me)
+{
+	me->packet_status = SIGNAL_PACKET_INVALID;
+	comm_queue_push(me);
+	return FSM_TRANSIT_TO(comm_state_frame);
+}
 
-status_t comm_state_frame(bootloader_fsm_t *const me, Event const *const e)
+static status_t comm_state_frame(bootloader_fsm_t *const me,
+				 Event const *const e)
 {
 	status_t state;
 	switch (e->sig) {
 	case SIGNAL_ENTRY: {
-		bytes_collected_counter = 0;
-		me->packet_status = SIGNAL_PACKET_NOT_READY;
+		comm_frame_entry(me);
 		state = STATE_HANDLED;
 		break;
 	}
 	case SIGNAL_BYTE_RECEIVED: {
-		if (me->uart_byte == packet_frame[bytes_collected_counter]) {
-			bytes_collected_counter++;
-			if (bytes_collected_counter == 4) {
-				state = FSM_TRANSIT_TO(comm_state_id);
-			}
+		state = STATE_HANDLED;
+		if (!comm_queue_has_room()) {
+			/* Dropped like a byte lost to a full ring */
+			break;
 		}
-		else {
-			bytes_collected_counter = 0;
+		bytes_collected_counter =
+			comm_frame_advance(bytes_collected_counter,
+					   me->uart_byte);
+		if (bytes_collected_counter == PACKET_FRAME_SIZE) {
+			state = FSM_TRANSIT_TO(comm_state_id);
 		}
+		break;
+	}
+	case SIGNAL_TIMEOUT: {
+		/* A partial sync word is not worth a resend */
+		comm_frame_entry(me);
 		state = STATE_HANDLED;
 		break;
 	}
@@ -56,20 +276,40 @@ status_t comm_state_frame(bootloader_fsm_t *const me, Event const *const e)
 	return state;
 }
 
-status_t comm_state_id(bootloader_fsm_t *const me, Event const *const e)
+/* Any state between the sync word and the last CRC byte */
+static status_t comm_state_packet(bootloader_fsm_t *const me,
+				  Event const *const e)
+{
+	status_t state;
+	switch (e->sig) {
+	case SIGNAL_TIMEOUT: {
+		state = comm_timeout(me);
+		break;
+	}
+
+	default: {
+		state = STATE_IGNORED;
+		break;
+	}
+	}
+	return state;
+}
+
+static status_t comm_state_id(bootloader_fsm_t *const me,
+			      Event const *const e)
 {
 	status_t state;
 	switch (e->sig) {
 	case SIGNAL_ENTRY: {
-		bytes_collected_counter = 0;
-		memset(&temp_packet, 0, sizeof(temp_packet));
-		memset(&temp_packet.payload, 0xFF, MAX_PAYLOAD_SIZE);
-		me->packet_status = SIGNAL_PACKET_NOT_READY;
+		comm_id_entry(me);
 		state = STATE_HANDLED;
 		break;
 	}
 	case SIGNAL_BYTE_RECEIVED: {
-		temp_packet.command_id = me->uart_byte;
+		rx_packet->command_id = me->uart_byte;
+		running_crc = stm32_crc32_accumulate(
+			running_crc, &rx_packet->command_id,
+			sizeof(rx_packet->command_id));
 		state = FSM_TRANSIT_TO(comm_state_length);
 		break;
 	}
@@ -81,22 +321,21 @@ status_t comm_state_id(bootloader_fsm_t *const me, Event const *const e)
 	}
 	return state;
 }
-status_t comm_state_length(bootloader_fsm_t *const me, Event const *const e)
+static status_t comm_state_length(bootloader_fsm_t *const me,
+				  Event const *const e)
 {
 	status_t state;
 	switch (e->sig) {
 	case SIGNAL_BYTE_RECEIVED: {
-		if (me->uart_byte < 1) {
-			temp_packet.length = 0;
-			state = FSM_TRANSIT_TO(comm_state_crc);
-		} else {
-			temp_packet.length = me->uart_byte;
-			state = FSM_TRANSIT_TO(comm_state_payload);
+		state = STATE_HANDLED;
+		if (comm_length_collect(me->uart_byte)) {
+			state = FSM_TRANSIT_TO_ID(comm_length_next());
 		}
 		break;
 	}
 	case SIGNAL_EXIT: {
 		me->packet_status = SIGNAL_PACKET_NOT_READY;
+		state = STATE_HANDLED;
 		break;
 	}
 
@@ -107,7 +346,8 @@ status_t comm_state_length(bootloader_fsm_t *const me, Event const *const e)
 	}
 	return state;
 }
-status_t comm_state_payload(bootloader_fsm_t *const me, Event const *const e)
+static status_t comm_state_payload(bootloader_fsm_t *const me,
+				   Event const *const e)
 {
 	status_t status;
 	switch (e->sig) {
@@ -118,13 +358,16 @@ status_t comm_state_payload(bootloader_fsm_t *const me, Event const *const e)
 	}
 
 	case SIGNAL_BYTE_RECEIVED: {
-		if (bytes_collected_counter < temp_packet.length) {
-			temp_packet.payload[bytes_collected_counter++] =
+		status = STATE_HANDLED;
+		if (bytes_collected_counter < rx_packet->length) {
+			rx_packet->payload[bytes_collected_counter++] =
 				me->uart_byte;
-			status = STATE_HANDLED;
+			running_crc = stm32_crc32_accumulate(
+				running_crc, &me->uart_byte,
+				sizeof(me->uart_byte));
 
 			// Check if payload collection is complete
-			if (bytes_collected_counter >= temp_packet.length) {
+			if (bytes_collected_counter >= rx_packet->length) {
 				status = FSM_TRANSIT_TO(comm_state_crc);
 			}
 		}
@@ -146,7 +389,8 @@ status_t comm_state_payload(bootloader_fsm_t *const me, Event const *const e)
 	return status;
 }
 
-status_t comm_state_crc(bootloader_fsm_t *const me, Event const *const e)
+static status_t comm_state_crc(bootloader_fsm_t *const me,
+			       Event const *const e)
 {
 	status_t state;
 	switch (e->sig) {
@@ -156,32 +400,19 @@ status_t comm_state_crc(bootloader_fsm_t *const me, Event const *const e)
 		break;
 	}
 	case SIGNAL_BYTE_RECEIVED: {
-		uint8_t *crc_bytes = (uint8_t *)&temp_packet.crc;
-		if (bytes_collected_counter < 4) {
+		uint8_t *crc_bytes = (uint8_t *)&rx_packet->crc;
+		state = STATE_HANDLED;
+		if (bytes_collected_counter < PACKET_BYTES_CRC) {
 			crc_bytes[bytes_collected_counter++] = me->uart_byte;
-			state = STATE_HANDLED;
-			if (bytes_collected_counter >= 4) {
-				bool valid =
-					bootloader_verify_crc(&temp_packet);
-				me->packet_status =
-					valid ? SIGNAL_PACKET_VALID :
-						SIGNAL_PACKET_INVALID;
-				state = FSM_TRANSIT_TO(
-					bootloader_fsm_verify_packet_id);
+			if (bytes_collected_counter >= PACKET_BYTES_CRC) {
+				comm_crc_complete(me);
+				comm_queue_push(me);
+				state = FSM_TRANSIT_TO(comm_state_frame);
 			}
 		}
 		break;
 	}
 
-	case SIGNAL_EXIT: {
-		if (me->packet_status == SIGNAL_PACKET_VALID) {
-			memcpy(&last_received_packet, &temp_packet,
-			       sizeof(temp_packet));
-		}
-		state = STATE_HANDLED;
-		break;
-	}
-
 	default: {
 		state = STATE_IGNORED;
 		break;
@@ -190,7 +421,118 @@ status_t comm_state_crc(bootloader_fsm_t *const me, Event const *const e)
 	return state;
 }
 
+/*
+ * Span parser: walks the same frame -> id -> length -> payload -> crc
+ * sequence as the handlers above, but switches on the current state
+ * directly and copies payload/crc runs in bulk instead of taking one
+ * comm_fsm_dispatch() per byte. Every complete packet is queued and
+ * parsing goes on with the next frame, it only stops early when the queue
+ * is full.
+ */
+uint32_t comm_process_bytes(bootloader_fsm_t *const me, const uint8_t *data,
+			    const uint32_t length)
+{
+	Fsm *const fsm = (Fsm *)me;
+	uint32_t consumed = 0;
+
+	while (consumed < length) {
+		StateId state = fsm->state;
+		uint32_t available = length - consumed;
+
+		if (state == FSM_ID(comm_state_frame)) {
+			if (!comm_queue_has_room()) {
+				break;
+			}
+			consumed += comm_frame_scan(&data[consumed], available);
+			if (bytes_collected_counter == PACKET_FRAME_SIZE) {
+				comm_id_entry(me);
+				fsm->state = FSM_ID(comm_state_id);
+			}
+		} else if (state == FSM_ID(comm_state_id)) {
+			rx_packet->command_id = data[consumed];
+			running_crc = stm32_crc32_accumulate(
+				running_crc, &data[consumed], 1);
+			consumed++;
+			fsm->state = FSM_ID(comm_state_length);
+		} else if (state == FSM_ID(comm_state_length)) {
+			if (comm_length_collect(data[consumed++])) {
+				StateId next = comm_length_next();
+				me->packet_status = SIGNAL_PACKET_NOT_READY;
+				bytes_collected_counter = 0;
+				if (next == FSM_ID(comm_state_frame)) {
+					comm_frame_entry(me);
+				}
+				fsm->state = next;
+			}
+		} else if (state == FSM_ID(comm_state_payload)) {
+			uint32_t remaining =
+				rx_packet->length - bytes_collected_counter;
+			uint32_t n = remaining < available ? remaining :
+							     available;
+			memcpy(&rx_packet->payload[bytes_collected_counter],
+			       &data[consumed], n);
+			running_crc = stm32_crc32_accumulate(
+				running_crc, &data[consumed], n);
+			bytes_collected_counter += n;
+			consumed += n;
+			if (bytes_collected_counter >= rx_packet->length) {
+				me->packet_status = SIGNAL_PACKET_NOT_READY;
+				bytes_collected_counter = 0;
+				fsm->state = FSM_ID(comm_state_crc);
+			}
+		} else if (state == FSM_ID(comm_state_crc)) {
+			uint8_t *crc_bytes = (uint8_t *)&rx_packet->crc;
+			uint32_t remaining =
+				PACKET_BYTES_CRC - bytes_collected_counter;
+			uint32_t n = remaining < available ? remaining :
+							     available;
+			memcpy(&crc_bytes[bytes_collected_counter],
+			       &data[consumed], n);
+			bytes_collected_counter += n;
+			consumed += n;
+			if (bytes_collected_counter >= PACKET_BYTES_CRC) {
+				comm_crc_complete(me);
+				comm_queue_push(me);
+				fsm->state = FSM_ID(comm_state_frame);
+			}
+		} else {
+			/* Not set up yet */
+			break;
+		}
+	}
+	return consumed;
+}
+
+FSM_DEFINE(comm_fsm, bootloader_fsm_t, COMM_STATES, comm_state_frame)
+
+/* Oldest queued packet, stays valid until comm_queue_pop() */
+comms_packet_t *comm_queue_front(EventSignals *const status)
+{
+	uint32_t tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&queue_head, memory_order_acquire);
+	comms_queue_entry_t *entry;
+
+	if (head == tail) {
+		return NULL;
+	}
+	entry = &packet_queue[tail % COMMS_PACKET_QUEUE_DEPTH];
+	*status = entry->status;
+	return &entry->packet;
+}
+
+void comm_queue_pop(void)
+{
+	uint32_t tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+	atomic_store_explicit(&queue_tail, tail + 1U, memory_order_release);
+}
+
 comms_packet_t *comm_get_last_packet(void)
 {
-	return &last_received_packet;
-}
\ No newline at end of file
+	uint32_t tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+	return &packet_queue[tail % COMMS_PACKET_QUEUE_DEPTH].packet;
+}
+
+uint8_t comm_get_rx_version(void)
+{
+	return comm_get_last_packet()->version;
+}
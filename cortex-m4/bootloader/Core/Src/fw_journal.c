@@ -0,0 +1,142 @@
+#include <stddef.h>
+#include <string.h>
+#include "fw_journal.h"
+#include "bootloader.h"
+#include "crc.h"
+#include "flash.h"
+
+/*
+ * The journal page starts with a header naming the image in transfer,
+ * followed by append only records of one double word [ offset ][ ~offset ]:
+ * everything below offset is programmed. Every double word is programmed
+ * once, so a reset tears at most the last one. The header CRC sits in its
+ * last double word and a torn record fails the complement (or ECC) check,
+ * so either is simply ignored.
+ */
+#define FW_JOURNAL_MAGIC (0x4A574653U)
+
+typedef struct __attribute__((packed)) fw_journal_header {
+	uint32_t magic;
+	fw_journal_key_t key;
+	uint32_t crc;
+} fw_journal_header_t;
+
+_Static_assert((sizeof(fw_journal_header_t) % sizeof(uint64_t)) == 0U,
+	       "journal header must fill whole double words");
+
+#define FW_JOURNAL_RECORDS_START \
+	(FOTA_JOURNAL_START + sizeof(fw_journal_header_t))
+#define FW_JOURNAL_RECORDS_END (FOTA_JOURNAL_START + FLASH_PAGE_SIZE)
+
+/* Next free record slot, 0 while no keyed transfer is journaled */
+static uint32_t record_address = 0U;
+static uint32_t recorded_offset = 0U;
+static uint32_t journal_fw_size = 0U;
+
+static uint32_t header_crc(const fw_journal_header_t *const header)
+{
+	return stm32_crc32_default((const uint8_t *)header,
+				   offsetof(fw_journal_header_t, crc));
+}
+
+/* Erase the journal; a key starts journaling a fresh transfer of that image */
+bool fw_journal_start(const fw_journal_key_t *const key)
+{
+	record_address = 0U;
+	recorded_offset = 0U;
+	if (!bootloader_erase_pages(FOTA_JOURNAL_BANK, FOTA_JOURNAL_PAGE, 1U)) {
+		return false;
+	}
+	if (key == NULL) {
+		return true;
+	}
+
+	fw_journal_header_t header = { .magic = FW_JOURNAL_MAGIC, .key = *key };
+	header.crc = header_crc(&header);
+
+	bool status = true;
+	for (uint32_t i = 0; status && (i < sizeof(header));
+	     i += sizeof(uint64_t)) {
+		uint64_t dw;
+		memcpy(&dw, (const uint8_t *)&header + i, sizeof(dw));
+		status = bootloader_flash_double_word(FOTA_JOURNAL_START + i,
+						      dw);
+	}
+	if (status) {
+		record_address = FW_JOURNAL_RECORDS_START;
+		journal_fw_size = key->fw_size;
+	}
+	return status;
+}
+
+/* Look up an interrupted transfer of the same image and the offset below
+ * which it was completely programmed */
+bool fw_journal_resume(const fw_journal_key_t *const key,
+		       uint32_t *const offset)
+{
+	fw_journal_header_t header;
+	record_address = 0U;
+	recorded_offset = 0U;
+
+	(void)bootloader_flash_ecc_error_take();
+	memcpy(&header, (const void *)FOTA_JOURNAL_START, sizeof(header));
+	if (bootloader_flash_ecc_error_take() ||
+	    (header.magic != FW_JOURNAL_MAGIC) ||
+	    (header.crc != header_crc(&header)) ||
+	    (memcmp(&header.key, key, sizeof(*key)) != 0)) {
+		return false;
+	}
+
+	uint32_t address = FW_JOURNAL_RECORDS_START;
+	for (; address < FW_JOURNAL_RECORDS_END; address += sizeof(uint64_t)) {
+		const volatile uint32_t *record =
+			(const volatile uint32_t *)address;
+		uint32_t value = record[0];
+		uint32_t check = record[1];
+		bool ecc_error = bootloader_flash_ecc_error_take();
+		if (!ecc_error && (value == UINT32_MAX) &&
+		    (check == UINT32_MAX)) {
+			break;
+		}
+		/* A torn slot is skipped, records after it are still valid */
+		if (!ecc_error && (value == ~check) &&
+		    (value > recorded_offset)) {
+			recorded_offset = value;
+		}
+	}
+
+	record_address = address;
+	journal_fw_size = key->fw_size;
+	*offset = recorded_offset;
+	return true;
+}
+
+/* Fed the contiguously received offset after every chunk; only crossing a
+ * page boundary or reaching the end of the image costs a record. While a
+ * page is programmed in the background the record waits for a later chunk
+ * rather than stalling this one */
+bool fw_journal_record(const uint32_t offset)
+{
+	if ((record_address == 0U) ||
+	    (record_address >= FW_JOURNAL_RECORDS_END)) {
+		return false;
+	}
+	if (bootloader_flash_busy()) {
+		return true;
+	}
+	bool crossed = (offset / FLASH_PAGE_SIZE) >
+		       (recorded_offset / FLASH_PAGE_SIZE);
+	bool finished = (offset >= journal_fw_size) &&
+			(recorded_offset < journal_fw_size);
+	if (!crossed && !finished) {
+		return true;
+	}
+
+	uint64_t record = ((uint64_t)(~offset) << 32) | offset;
+	bool status = bootloader_flash_double_word(record_address, record);
+	record_address += sizeof(uint64_t);
+	if (status) {
+		recorded_offset = offset;
+	}
+	return status;
+}
@@ -53,8 +53,6 @@
 
 UART_HandleTypeDef *fota_uart = &huart2;
 
-uint8_t dmadata[MAX_PAYLOAD_SIZE * 2];
-
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -65,9 +63,19 @@ void SystemClock_Config(void);
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
-void bl_send_bytes(const uint8_t *data, const uint32_t size)
+bool bl_send_bytes(const uint8_t *data, const uint32_t size)
+{
+	uint32_t timeout =
+		BOOTLOADER_TX_TIMEOUT_MS(size, fota_uart->Init.BaudRate);
+	return HAL_UART_Transmit(fota_uart, data, (uint16_t)size, timeout) ==
+	       HAL_OK;
+}
+
+/* One DMA transfer per response, HAL_UART_TxCpltCallback fires on TC */
+bool bl_send_bytes_async(const uint8_t *data, const uint32_t size)
 {
-	HAL_UART_Transmit(fota_uart, data, size, 100);
+	return HAL_UART_Transmit_DMA(fota_uart, data, (uint16_t)size) ==
+	       HAL_OK;
 }
 
 void bl_deinit(void)
@@ -97,18 +105,57 @@ void setup_cb(void)
 		(void)dummy_read; // Prevent compiler optimization
 	}
 
-	// 4. Start DMA Reception
+	// 4. Start circular DMA Reception straight into the ring buffer
 	// DO NOT manually call __HAL_UART_ENABLE_IT(&fota_uart, UART_IT_IDLE);
 	// HAL_UARTEx_ReceiveToIdle_DMA already enables the required interrupts.
-	if (HAL_UARTEx_ReceiveToIdle_DMA(fota_uart, dmadata, sizeof(dmadata)) !=
-	    HAL_OK) {
+	// Idle, half and full transfer all report the write position.
+	uint16_t size;
+	uint8_t *storage = bootloader_rx_storage(&size);
+	bootloader_rx_reset();
+
+	// 5. Receiver timeout, aborts a packet the host stopped sending
+	HAL_UART_ReceiverTimeout_Config(
+		fota_uart, BOOTLOADER_RX_TIMEOUT_BITS(fota_uart->Init.BaudRate));
+	HAL_UART_EnableReceiverTimeout(fota_uart);
+	__HAL_UART_CLEAR_FLAG(fota_uart, UART_CLEAR_RTOF);
+	__HAL_UART_ENABLE_IT(fota_uart, UART_IT_RTO);
+	if (HAL_UARTEx_ReceiveToIdle_DMA(fota_uart, storage, size) != HAL_OK) {
 		Error_Handler();
 	}
+}
 
-	// Optional: Disable Half-Transfer interrupt to avoid double-triggering
-	__HAL_DMA_DISABLE_IT(fota_uart->hdmarx, DMA_IT_HT);
+/* Called once the last response has left the shifter (TC). Only BRR
+ * changes, the circular DMA reception keeps running */
+bool bl_set_baudrate(const uint32_t baudrate)
+{
+	__HAL_UART_DISABLE(fota_uart);
+	fota_uart->Init.BaudRate = baudrate;
+	HAL_StatusTypeDef ret = UART_SetConfig(fota_uart);
+	HAL_UART_ReceiverTimeout_Config(fota_uart,
+					BOOTLOADER_RX_TIMEOUT_BITS(baudrate));
+	__HAL_UART_ENABLE(fota_uart);
+	return ret == HAL_OK ? true : false;
 }
 
+/* SysTick sample of the circular DMA, only while it runs */
+bool bl_rx_position(uint32_t *const position)
+{
+	if (fota_uart->RxState != HAL_UART_STATE_BUSY_RX) {
+		return false;
+	}
+	*position = fota_uart->RxXferSize -
+		    __HAL_DMA_GET_COUNTER(fota_uart->hdmarx);
+	return true;
+}
+
+#if BOOTLOADER_UART_FLOW_CONTROL
+void bl_set_rx_ready(const bool ready)
+{
+	HAL_GPIO_WritePin(USART_RTS_GPIO_Port, USART_RTS_Pin,
+			  ready ? GPIO_PIN_RESET : GPIO_PIN_SET);
+}
+#endif
+
 /* USER CODE END 0 */
 
 /**
@@ -151,7 +198,14 @@ int main(void)
 
 	bl_handle_t bl_handle = {
 
-		.serrif = { .wb = bl_send_bytes },
+		.serrif = { .wb = bl_send_bytes,
+			    .wb_async = bl_send_bytes_async,
+			    .set_baudrate = bl_set_baudrate,
+			    .rx_position = bl_rx_position,
+#if BOOTLOADER_UART_FLOW_CONTROL
+			    .set_rx_ready = bl_set_rx_ready
+#endif
+		},
 		.deinit = bl_deinit
 	};
 	bootloader_setup(&bl_handle);
@@ -222,54 +276,46 @@ void SystemClock_Config(void)
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
 {
 	if (huart->Instance == fota_uart->Instance) {
-		uint32_t error_code = HAL_UART_GetError(huart);
-
-		// Framing Error (FE) Detected
-		if (error_code & HAL_UART_ERROR_FE) {
-			// A framing error often means the baud rate is slightly off
-			// or the line was disconnected/glitched.
-
-			// 1. Clear the FE flag by writing to ICR
-			__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_FEF);
-
-			// 2. Read the data register to flush the 'bad' byte
-			volatile uint32_t dummy = huart->Instance->RDR;
-			(void)dummy;
-
-			// 3. Re-sync the DMA
+		// Framing and noise errors leave the circular DMA running, the
+		// damaged packet fails its CRC. Overrun detection is disabled.
+		// Only a reception HAL had to abort is restarted, which drops
+		// whatever was buffered.
+		__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF | UART_CLEAR_NEF |
+						     UART_CLEAR_FEF);
+		if (huart->RxState != HAL_UART_STATE_BUSY_RX) {
 			setup_cb();
 		}
+	}
+}
 
-		// Handle Overrun (ORE) - common if ESP32 sends while STM32 is in ISR
-		if (error_code & HAL_UART_ERROR_ORE) {
-			__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF);
-			setup_cb();
-		}
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance == fota_uart->Instance) {
+		bootloader_tx_complete();
 	}
 }
 
 /**
- * @brief  Reception Event Callback (Handles IDLE and Complete events)
+ * @brief  Reception Event Callback (Handles IDLE, half and full transfer)
  * @param  huart: UART handle
- * @param  Size: Number of bytes actually received
-
- 
- "%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x " ((uint8_t*)dmadata)[0] ((uint8_t*)dmadata)[1] ((uint8_t*)dmadata)[2] ((uint8_t*)dmadata)[3] ((uint8_t*)dmadata)[4] ((uint8_t*)dmadata)[5] ((uint8_t*)dmadata)[6] ((uint8_t*)dmadata)[7] ((uint8_t*)dmadata)[8] ((uint8_t*)dmadata)[9] ((uint8_t*)dmadata)[10] ((uint8_t*)dmadata)[11] ((uint8_t*)dmadata)[12] ((uint8_t*)dmadata)[13] ((uint8_t*)dmadata)[14] ((uint8_t*)dmadata)[14]
+ * @param  Size: Offset in the ring storage the DMA has written up to
  */
-
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
 {
-	(void)Size;
 	if (huart->Instance == fota_uart->Instance) {
-		uint16_t received = sizeof(dmadata) -
-				    __HAL_DMA_GET_COUNTER(fota_uart->hdmarx);
-		for (size_t i = 0; i < received; i++) {
-			bootloader_byte_received(dmadata[i]);
-		}
-		setup_cb();
+		bootloader_rx_dma_position(Size);
 	}
 }
 
+/* RTOF, taken out of USART2_IRQHandler before HAL sees it: HAL counts it
+ * as a receive error and would stop the circular DMA */
+void bl_uart_rx_timeout(void)
+{
+	bootloader_rx_dma_position(fota_uart->RxXferSize -
+				   __HAL_DMA_GET_COUNTER(fota_uart->hdmarx));
+	bootloader_rx_timeout();
+}
+
 /* USER CODE END 4 */
 
 /**
@@ -1,29 +1,322 @@
 #include "packet_controller.h"
+#include "bootloader.h"
 #include "sm_common.h"
 #include "flash.h"
 #include "math.h"
 
+static inline bool chunk_received(const packet_controller_t *const pcontroller,
+				  const uint32_t seq)
+{
+	return (pcontroller->received[seq / 32U] & (1UL << (seq % 32U))) != 0U;
+}
+
 static void setup_fw_packet(packet_controller_t *const pcontroller)
 {
 	pcontroller->total_packets =
-		(pcontroller->fw_size + (MAX_PAYLOAD_SIZE - 1)) /
-		MAX_PAYLOAD_SIZE;
+		(pcontroller->fw_size + (pcontroller->chunk_size - 1U)) /
+		pcontroller->chunk_size;
 	pcontroller->current_packet_number = 0U;
 }
 
-void packet_controller_init(packet_controller_t *const pcontroller,
-			    const uint32_t fw_size)
+bool packet_controller_init(packet_controller_t *const pcontroller,
+			    const uint32_t fw_size, const uint16_t chunk_size,
+			    const bool windowed)
 {
 	if (pcontroller == NULL) {
-		return;
+		return false;
 	}
+	/* A transfer cut short may still be programming its last page */
+	(void)bootloader_flash_wait();
 	memset(pcontroller, 0, sizeof(packet_controller_t));
+	if ((chunk_size < PACKET_MIN_CHUNK_SIZE) || (fw_size == 0U) ||
+	    (fw_size > PACKET_IMAGE_MAX_SIZE)) {
+		return false;
+	}
 	pcontroller->current_flash_address = FOTA_SHARED_START;
 	pcontroller->fw_size = fw_size;
+	pcontroller->chunk_size = chunk_size;
+	pcontroller->windowed = windowed;
 	setup_fw_packet(pcontroller);
+	return true;
 }
 
 void packet_controller_reset(packet_controller_t *const pcontroller)
 {
+	(void)bootloader_flash_wait();
 	memset(pcontroller, 0, sizeof(packet_controller_t));
-}
\ No newline at end of file
+}
+
+/* Chunks below seq survived an interrupted transfer and count as received */
+void packet_controller_resume_at(packet_controller_t *const pcontroller,
+				 const uint32_t seq)
+{
+	uint32_t n = seq < pcontroller->total_packets ?
+			     seq :
+			     pcontroller->total_packets;
+	for (uint32_t i = 0; i < (n / 32U); i++) {
+		pcontroller->received[i] = UINT32_MAX;
+	}
+	if ((n % 32U) != 0U) {
+		pcontroller->received[n / 32U] |= (1UL << (n % 32U)) - 1U;
+	}
+	pcontroller->current_packet_number = n;
+	pcontroller->current_flash_address =
+		packet_controller_address(pcontroller, n);
+}
+
+uint32_t packet_controller_address(const packet_controller_t *const pcontroller,
+				   const uint32_t seq)
+{
+	return FOTA_SHARED_START + (seq * pcontroller->chunk_size);
+}
+
+/* Every chunk is chunk_size long except the last, which holds the rest */
+uint16_t
+packet_controller_chunk_length(const packet_controller_t *const pcontroller,
+			       const uint32_t seq)
+{
+	uint32_t left = pcontroller->fw_size - (seq * pcontroller->chunk_size);
+	return left < pcontroller->chunk_size ? (uint16_t)left :
+						pcontroller->chunk_size;
+}
+
+/* Offsets must land on a chunk boundary, anything else is a broken host */
+bool packet_controller_offset_to_seq(
+	const packet_controller_t *const pcontroller, const uint32_t offset,
+	uint32_t *const seq)
+{
+	if ((offset % pcontroller->chunk_size) != 0U) {
+		return false;
+	}
+	*seq = offset / pcontroller->chunk_size;
+	return true;
+}
+
+packet_admission_t
+packet_controller_admit(const packet_controller_t *const pcontroller,
+			const uint32_t seq)
+{
+	if (seq >= pcontroller->total_packets) {
+		return PACKET_OUT_OF_RANGE;
+	}
+	return chunk_received(pcontroller, seq) ? PACKET_DUPLICATE : PACKET_NEW;
+}
+
+/* Record a written chunk; the in-order one moves the cumulative ACK over
+ * every chunk that already arrived ahead of it */
+void packet_controller_mark_received(packet_controller_t *const pcontroller,
+				     const uint32_t seq)
+{
+	pcontroller->received[seq / 32U] |= 1UL << (seq % 32U);
+
+	while ((pcontroller->current_packet_number <
+		pcontroller->total_packets) &&
+	       chunk_received(pcontroller,
+			      pcontroller->current_packet_number)) {
+		pcontroller->current_packet_number++;
+	}
+	pcontroller->current_flash_address = packet_controller_address(
+		pcontroller, pcontroller->current_packet_number);
+}
+
+/* bit i set: chunk current_packet_number + 1 + i is already written */
+uint32_t
+packet_controller_sack_bitmap(const packet_controller_t *const pcontroller)
+{
+	uint32_t bitmap = 0U;
+	for (uint32_t i = 0; i < PACKET_WINDOW_SIZE; i++) {
+		uint32_t seq = pcontroller->current_packet_number + 1U + i;
+		if (seq >= pcontroller->total_packets) {
+			break;
+		}
+		if (chunk_received(pcontroller, seq)) {
+			bitmap |= 1UL << i;
+		}
+	}
+	return bitmap;
+}
+
+bool packet_controller_is_complete(const packet_controller_t *const pcontroller)
+{
+	return pcontroller->current_packet_number >= pcontroller->total_packets;
+}
+
+/* Wait for the page programmed in the background; from then on it counts
+ * as committed */
+static bool page_settle(packet_controller_t *const pcontroller)
+{
+	bool status = true;
+
+	if (pcontroller->flashing.base != 0U) {
+		status = bootloader_flash_wait();
+		pcontroller->flashing.base = 0U;
+	}
+	return status;
+}
+
+/*
+ * Complete the staged page with what flash holds and compare the two. An
+ * identical page is skipped. A double word can be programmed in place only
+ * while it is still erased (or to all zeros), so the page is erased only
+ * if some changed double word is neither. A double word that fails ECC
+ * counts as changed. The page is then programmed in the background from a
+ * copy, so the next one can be gathered meanwhile.
+ */
+static bool page_commit(packet_controller_t *const pcontroller)
+{
+	packet_page_t *page = &pcontroller->page;
+	const volatile uint64_t *flash = (const volatile uint64_t *)page->base;
+	uint32_t end = FOTA_SHARED_START + pcontroller->fw_size;
+	uint32_t index = (page->base - FOTA_SHARED_START) / FLASH_PAGE_SIZE;
+	uint32_t bit = 1UL << (index % 32U);
+	uint32_t *skipped = &pcontroller->page_skipped[index / 32U];
+	uint32_t *programmed = &pcontroller->page_programmed[index / 32U];
+	bool changed = false;
+	bool erase = false;
+
+	if (!page_settle(pcontroller)) {
+		return false;
+	}
+	(void)bootloader_flash_ecc_error_take();
+	/* Past the end of the image the last double word keeps its bytes */
+	if (((end - page->base) < FLASH_PAGE_SIZE) &&
+	    ((end % sizeof(uint64_t)) != 0U)) {
+		memcpy((uint8_t *)page->data + (end - page->base),
+		       (const void *)end,
+		       sizeof(uint64_t) - (end % sizeof(uint64_t)));
+	}
+	for (uint32_t i = 0; i < PACKET_PAGE_DWORDS; i++) {
+		uint64_t dw = flash[i];
+		if ((page->written[i / 32U] & (1UL << (i % 32U))) == 0U) {
+			page->data[i] = dw;
+		} else if (dw != page->data[i]) {
+			changed = true;
+			erase = erase ||
+				((dw != UINT64_MAX) && (page->data[i] != 0U));
+		}
+	}
+	if (bootloader_flash_ecc_error_take()) {
+		changed = true;
+		erase = true;
+	}
+
+	if (!changed) {
+		if (((*skipped | *programmed) & bit) == 0U) {
+			*skipped |= bit;
+			pcontroller->pages_skipped++;
+		}
+		return true;
+	}
+	if ((*skipped & bit) != 0U) {
+		*skipped &= ~bit;
+		pcontroller->pages_skipped--;
+	}
+	*programmed |= bit;
+	if (erase && !bootloader_erase_page_it(FOTA_SHARED_APP_BANK,
+					       FOTA_SHARED_APP_PAGE + index)) {
+		return false;
+	}
+	memcpy(pcontroller->flashing.data, page->data, FLASH_PAGE_SIZE);
+	pcontroller->flashing.base = page->base;
+	return bootloader_flash_program_start(pcontroller->flashing.base,
+					      pcontroller->flashing.data,
+					      PACKET_PAGE_DWORDS);
+}
+
+/* Bytes of the image that fall into the page at base */
+static uint32_t page_image_bytes(const packet_controller_t *const pcontroller,
+				 const uint32_t base)
+{
+	uint32_t end = FOTA_SHARED_START + pcontroller->fw_size;
+	return (end - base) < FLASH_PAGE_SIZE ? (end - base) : FLASH_PAGE_SIZE;
+}
+
+static bool page_close(packet_controller_t *const pcontroller)
+{
+	bool status = true;
+
+	if (pcontroller->page.base != 0U) {
+		status = page_commit(pcontroller);
+		pcontroller->page.base = 0U;
+	}
+	return status;
+}
+
+/* Commit the open page and wait until everything is in flash */
+bool packet_controller_flush(packet_controller_t *const pcontroller)
+{
+	bool status = page_close(pcontroller);
+	return page_settle(pcontroller) && status;
+}
+
+/*
+ * Program image data through the page stage. A page is committed once all
+ * of the image that falls into it has arrived, or earlier when data for
+ * another page shows up, e.g. out of order chunks; revisiting it later
+ * starts from what was committed then.
+ */
+bool packet_controller_write(packet_controller_t *const pcontroller,
+			     uint32_t address, const uint8_t *data,
+			     uint16_t length)
+{
+	packet_page_t *page = &pcontroller->page;
+	bool status = true;
+
+	/* Settle a finished background page without waiting for it */
+	if ((pcontroller->flashing.base != 0U) && !bootloader_flash_busy()) {
+		status = page_settle(pcontroller);
+	}
+
+	while (status && (length > 0U)) {
+		uint32_t offset = address % FLASH_PAGE_SIZE;
+		uint32_t base = address - offset;
+		uint16_t n = (uint16_t)(FLASH_PAGE_SIZE - offset);
+		n = n < length ? n : length;
+
+		if ((page->base != 0U) && (page->base != base)) {
+			status = page_close(pcontroller);
+			continue;
+		}
+		if (page->base == 0U) {
+			memset(page->written, 0, sizeof(page->written));
+			page->base = base;
+			page->filled = 0U;
+		}
+		memcpy((uint8_t *)page->data + offset, data, n);
+		for (uint32_t i = offset / sizeof(uint64_t);
+		     i < ((offset + n + sizeof(uint64_t) - 1U) /
+			  sizeof(uint64_t));
+		     i++) {
+			page->written[i / 32U] |= 1UL << (i % 32U);
+		}
+		page->filled = (uint16_t)(page->filled + n);
+		address += n;
+		data += n;
+		length = (uint16_t)(length - n);
+
+		if (page->filled >= page_image_bytes(pcontroller, base)) {
+			status = page_close(pcontroller);
+		}
+	}
+	return status;
+}
+
+/* Image offset up to which everything acknowledged is in flash, i.e. the
+ * cumulative ACK unless part of it still waits in the page stage or is
+ * being programmed */
+uint32_t
+packet_controller_committed_offset(const packet_controller_t *const pcontroller)
+{
+	uint32_t committed =
+		pcontroller->current_packet_number * pcontroller->chunk_size;
+	uint32_t bases[] = { pcontroller->page.base,
+			     pcontroller->flashing.base };
+
+	for (uint32_t i = 0; i < (sizeof(bases) / sizeof(bases[0])); i++) {
+		if ((bases[i] != 0U) &&
+		    ((bases[i] - FOTA_SHARED_START) < committed)) {
+			committed = bases[i] - FOTA_SHARED_START;
+		}
+	}
+	return committed;
+}
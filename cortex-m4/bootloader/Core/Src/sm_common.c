@@ -8,33 +8,4 @@ Event const entry_event = { SIGNAL_ENTRY };
 Event const exit_event = { SIGNAL_EXIT };
 Event const init_event = { SIGNAL_INIT };
 Event const event_sync_requested = { SIGNAL_SYNC_REQUESTED };
-
-status_t hsm_top_status(Fsm *const me, Event const *const e)
-{
-	(void)me;
-	(void)e;
-	return STATE_IGNORED;
-}
-void Fsm_ctor(Fsm *const me, StateHandler initial)
-{
-	me->state = initial;
-}
-
-void Fsm_init(Fsm *const me, Event const *const e)
-{
-	assert(me->state != NULL);
-	(*me->state)(me, e);
-	(*me->state)(me, &entry_event);
-}
-
-void Fsm_dispatch(Fsm *const me, Event const *const e)
-{
-	status_t status;
-	StateHandler prev = me->state;
-	status = (*me->state)(me, e);
-
-	if (status == STATE_TRANSITION) {
-		(prev)(me, &exit_event);
-		(*me->state)(me, &entry_event);
-	}
-}
+Event const event_timeout = { SIGNAL_TIMEOUT };
@@ -10,12 +10,16 @@ from .commands.command_erase_flash import CommandEraseFlash
 from .commands.command_fw_update_sync import CommandFWUpdateSync
 from .commands.command_get_app_version import CommandGetAppVersion
 from .commands.command_get_bootloader_version import CommandGetBootloaderVersion
+from .commands.command_get_capabilities import CommandGetCapabilities
 from .commands.command_get_chip_id import CommandGetChipID
 from .commands.command_get_help import CommandGetHelp
+from .commands.command_get_range_crc import CommandGetRangeCRC
 from .commands.command_get_rdp_level import CommandGetRDPLevel
 from .commands.command_jump_to_address import CommandJumpToAddress
 from .commands.command_retransmit import CommandRetransmit
+from .commands.command_set_baudrate import CommandSetBaudrate
 from .commands.command_fw_verify_device_id import CommandFWVerifyDeviceID
 from .commands.command_fw_send_bin_size import CommandFWSendBinSize
+from .commands.command_fw_session_setup import CommandFWSessionSetup
 from .commands.command_fw_send_bin_in_packets import CommandFWSendBinInPackets
 from .crc_calculator import CRCCalculator
@@ -10,6 +10,62 @@ from .crc_calculator import CRCCalculator
 
 
 PACKET_FRAME = bytearray([0xA5, 0xAA, 0xBB, 0xA5])
+PACKET_FRAME_V2 = bytearray([0xA5, 0xAA, 0xBB, 0xA6])
+
+PROTOCOL_VERSION_1 = 1
+PROTOCOL_VERSION_2 = 2
+
+MAX_PAYLOAD_V1 = 16
+MAX_PAYLOAD_V2 = 2048
+
+# Capability flags in the v2 sync payload
+SYNC_FLAG_WINDOWED = 0x01
+
+
+@dataclass
+class ProtocolSession:
+    """
+    Framing agreed with the bootloader during B_CMD_SYNC.
+    v1: 1 byte length, 16 byte payloads. v2: 2 byte little-endian length,
+    payload size negotiated up to MAX_PAYLOAD_V2.
+    """
+
+    version: int = PROTOCOL_VERSION_1
+    max_payload: int = MAX_PAYLOAD_V1
+    flags: int = 0
+    # data packets in flight, 1 is plain stop-and-wait
+    window: int = 1
+    # firmware bytes per data packet, reported by B_CMD_SEND_BIN_SIZE
+    chunk_size: int = MAX_PAYLOAD_V1
+    # image offset an interrupted transfer of the same image continues from
+    resume_offset: int = 0
+
+    @property
+    def windowed(self) -> bool:
+        return bool(self.flags & SYNC_FLAG_WINDOWED)
+
+    @property
+    def frame(self) -> bytearray:
+        return PACKET_FRAME_V2 if self.version == PROTOCOL_VERSION_2 else PACKET_FRAME
+
+    @property
+    def length_bytes(self) -> int:
+        return 2 if self.version == PROTOCOL_VERSION_2 else 1
+
+    def encode_length(self, length: int) -> bytes:
+        return length.to_bytes(self.length_bytes, byteorder="little")
+
+    def reset(self) -> None:
+        self.version = PROTOCOL_VERSION_1
+        self.max_payload = MAX_PAYLOAD_V1
+        self.flags = 0
+        self.window = 1
+        self.chunk_size = MAX_PAYLOAD_V1
+        self.resume_offset = 0
+
+
+protocol_session = ProtocolSession()
+
 
 class ErrorCodes(Enum):
     ERROR_INVALID_COMMAND = 0x11
@@ -35,6 +91,10 @@ class CommandIDs(Enum):
     B_CMD_GET_RDP_LVL = auto()
     B_CMD_JMP_TO_ADDR = auto()
     B_CMD_ERASE_FLASH = auto()
+    B_CMD_SET_BAUDRATE = auto()
+    B_CMD_GET_CAPABILITIES = auto()
+    B_CMD_BATCH = auto()
+    B_CMD_GET_RANGE_CRC = auto()
 
 
 @dataclass
@@ -111,7 +171,7 @@ class Command(ABC):
         # Build data exactly like STM32 expects
         data = bytearray()
         data.append(pkt.id & 0xFF)
-        data.append(pkt.length & 0xFF)
+        data.extend(protocol_session.encode_length(pkt.length))
 
         if pkt.length > 0 and pkt.payload:
             data.extend([b & 0xFF for b in pkt.payload[: pkt.length]])
@@ -172,8 +232,8 @@ class Command(ABC):
 
         Packet structure:
         - Byte 0: ID (ACK/NACK)
-        - Byte 1: Payload length
-        - Bytes 2 to (2+length-1): Payload (if length > 0)
+        - Byte 1 (v2: bytes 1-2, little-endian): Payload length
+        - Next length bytes: Payload (if length > 0)
         - Last 4 bytes: CRC32 (little-endian)
 
         Args:
@@ -187,10 +247,12 @@ class Command(ABC):
             f"[RX] Raw data ({len(raw_data)} bytes): {' '.join([f'{b:02X}' for b in raw_data])}"
         )
 
-        # Minimum packet: ID(1) + Length(1) + CRC(4) = 6 bytes
-        if len(raw_data) < 6:
+        # Minimum packet: ID(1) + Length(1 or 2) + CRC(4)
+        length_bytes = protocol_session.length_bytes
+        min_size = 1 + length_bytes + 4
+        if len(raw_data) < min_size:
             print(
-                f"[RX] ERROR: Insufficient data (minimum 6 bytes, got {len(raw_data)})"
+                f"[RX] ERROR: Insufficient data (minimum {min_size} bytes, got {len(raw_data)})"
             )
             return None
 
@@ -203,15 +265,17 @@ class Command(ABC):
         print(f"[RX] Step 1 - Parse ID:")
         print(f"     Byte[0] = 0x{packet_id:02X} ({ResponseType(packet_id).name})")
 
-        # Step 2: Parse length (byte 1)
-        payload_length = raw_data[offset]
-        offset += 1
+        # Step 2: Parse length (byte 1, v2 adds byte 2)
+        payload_length = int.from_bytes(
+            raw_data[offset : offset + length_bytes], byteorder="little"
+        )
+        offset += length_bytes
 
         print(f"[RX] Step 2 - Parse Length:")
-        print(f"     Byte[1] = {payload_length} bytes")
+        print(f"     Bytes[1:{offset}] = {payload_length} bytes")
 
         # Validate total packet size
-        expected_size = 1 + 1 + payload_length + 4  # ID + Len + Payload + CRC
+        expected_size = offset + payload_length + 4  # ID + Len + Payload + CRC
         if len(raw_data) < expected_size:
             print(f"[RX] ERROR: Incomplete packet")
             print(f"     Expected: {expected_size} bytes")
@@ -224,7 +288,7 @@ class Command(ABC):
             payload = list(raw_data[offset : offset + payload_length])
             print(f"[RX] Step 3 - Parse Payload:")
             print(
-                f"     Bytes[2:{2 + payload_length}] = {' '.join([f'{b:02X}' for b in payload])}"
+                f"     Bytes[{offset}:{offset + payload_length}] = {' '.join([f'{b:02X}' for b in payload])}"
             )
             offset += payload_length
         else:
@@ -245,7 +309,7 @@ class Command(ABC):
         # CRC is computed over: [ID][Length][Payload]
         crc_data = bytearray()
         crc_data.append(packet_id)
-        crc_data.append(payload_length)
+        crc_data.extend(protocol_session.encode_length(payload_length))
         if payload_length > 0:
             crc_data.extend(payload)
 
@@ -278,7 +342,8 @@ class Command(ABC):
         """Generate raw byte array to send: id + length + payload + crc (little-endian)"""
         # pkt: Packet = self.packet()
         pkt.crc32 = self.compute_crc32_for_packet(pkt)
-        raw = bytearray([pkt.id & 0xFF, pkt.length & 0xFF])
+        raw = bytearray([pkt.id & 0xFF])
+        raw.extend(protocol_session.encode_length(pkt.length))
         if pkt.length > 0:
             assert pkt.payload, "Payload can't be None"
             raw.extend([b & 0xFF for b in pkt.payload])
@@ -326,13 +391,16 @@ class Command(ABC):
         assert port
 
         if show_debug:
+            length_end = 1 + protocol_session.length_bytes
+            length = int.from_bytes(raw_cmd[1:length_end], byteorder="little")
             print("[TX] Command Packet Breakdown:")
             print(f"     Total bytes: {len(raw_cmd)}")
+            print(f"     Version:     {protocol_session.version}")
             print(f"     ID:          0x{raw_cmd[0]:02X}")
-            print(f"     Length:      {raw_cmd[1]}")
+            print(f"     Length:      {length}")
 
-            if raw_cmd[1] > 0:
-                payload_bytes = raw_cmd[2 : 2 + raw_cmd[1]]
+            if length > 0:
+                payload_bytes = raw_cmd[length_end : length_end + length]
                 print(
                     f"     Payload:     {' '.join([f'{b:02X}' for b in payload_bytes])}"
                 )
@@ -350,9 +418,10 @@ class Command(ABC):
         port.reset_input_buffer()
         port.reset_output_buffer()
 
-        bytes_sent = port.write((PACKET_FRAME + raw_cmd))
+        frame = protocol_session.frame
+        bytes_sent = port.write((frame + raw_cmd))
         port.flush()
-        print(f"[TX] ✓ Sent {bytes_sent}/{len(raw_cmd) + len(PACKET_FRAME)} bytes")
+        print(f"[TX] ✓ Sent {bytes_sent}/{len(raw_cmd) + len(frame)} bytes")
         # time.sleep(0.01)
 
         if expect_response:
@@ -391,14 +460,19 @@ class Command(ABC):
         response_buffer.append(packet_id)
         print(f"[RX]   ID = 0x{packet_id:02X} ({hex(packet_id)})")
 
-        print("[RX] - Reading Length byte...")
-        payload_length = self.read_byte_with_timeout(port, self.timeout)
+        print("[RX] - Reading Length byte(s)...")
+        length_bytes = bytearray()
+        for _ in range(protocol_session.length_bytes):
+            length_byte = self.read_byte_with_timeout(port, self.timeout)
 
-        if payload_length is None:
-            print("[RX] ✗ Timeout waiting for Length byte")
-            return None
+            if length_byte is None:
+                print("[RX] ✗ Timeout waiting for Length byte")
+                return None
+            length_bytes.append(length_byte)
 
-        response_buffer.append(payload_length)
+        response_buffer.extend(length_bytes)
+        payload_length = int.from_bytes(length_bytes, byteorder="little")
+        header_size = len(response_buffer)
         print(f"[RX]   Length = {payload_length} bytes")
 
         if payload_length > 0:
@@ -416,7 +490,9 @@ class Command(ABC):
                 response_buffer.append(payload_byte)
 
                 if (i + 1) % 16 == 0 or (i + 1) == payload_length:
-                    payload_so_far = " ".join([f"{b:02X}" for b in response_buffer[2:]])
+                    payload_so_far = " ".join(
+                        [f"{b:02X}" for b in response_buffer[header_size:]]
+                    )
                     print(
                         f"[RX]   Payload [{i + 1}/{payload_length}]: {payload_so_far}"
                     )
@@ -6,10 +6,40 @@ from pathlib import Path
 from serial import Serial
 
 from ..crc_calculator import CRCCalculator
+from .command_get_range_crc import RANGE_SIZE, CommandGetRangeCRC
 
-from ..command import Command, CommandExecutionResponse, CommandIDs, CommandInfo, Packet
+from ..command import (
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+    ResponseType,
+    protocol_session,
+)
+
+# Windowed replies: [ offset received contiguously ][ SACK bitmap ],
+# bit i = chunk after that offset + 1 + i
+SACK_BITS = 32
+
+
+def flash_stats(payload) -> tuple[int, int]:
+    """v2 data replies end with [ flash busy us ][ flash wait us ]"""
+    busy = int.from_bytes(payload[12:16], byteorder="little")
+    wait = int.from_bytes(payload[16:20], byteorder="little")
+    return busy, wait
+
+
+def print_flash_stats(stats: tuple[int, int] | None) -> None:
+    if not stats:
+        return
+    busy, wait = stats
+    overlap = 100 * (busy - wait) / busy if busy else 0
+    print(
+        f"Flash busy {busy / 1000:.1f} ms, waited for {wait / 1000:.1f} ms, "
+        f"{overlap:.0f}% overlapped with transfer"
+    )
 
-MAX_PAYLOAD = 16
 
 # APP_OFFSET = 0x800  # FOTA shared region size
 # APP_SIZE_OFFSET = 20
@@ -19,6 +49,7 @@ MAX_PAYLOAD = 16
 @dataclass
 class BinFWUpdateMetaData:
     bin_file_path: Path
+    chunk_size: int = field(default_factory=lambda: protocol_session.chunk_size)
     current_packet_count: int = 0
     total_packets: int = field(init=False)
     bin_size: int = field(init=False)
@@ -47,12 +78,13 @@ class BinFWUpdateMetaData:
         # self.raw_bytes[CRC_OFFSET : CRC_OFFSET + 4] = struct.pack("<I", app_crc)
 
         self.bin_size = len(self.raw_bytes)
-        self.total_packets = (self.bin_size + MAX_PAYLOAD - 1) // MAX_PAYLOAD
+        self.total_packets = (self.bin_size + self.chunk_size - 1) // self.chunk_size
 
     def __str__(self) -> str:
         return (
             f"BinFWUpdateMetaData(\n"
             f"  bin_file_path       = {self.bin_file_path},\n"
+            f"  chunk_size          = {self.chunk_size},\n"
             f"  current_packet_count= {self.current_packet_count},\n"
             f"  total_packets       = {self.total_packets},\n"
             f"  bin_size            = {self.bin_size},\n"
@@ -60,13 +92,16 @@ class BinFWUpdateMetaData:
             f")"
         )
 
+    def chunk(self, seq: int) -> bytes:
+        return self.raw_bytes[seq * self.chunk_size : (seq + 1) * self.chunk_size]
+
     def generator_bin_bytes_for_packet(self):
         """
-        Yields packets of MAX_PAYLOAD bytes.
+        Yields packets of chunk_size bytes, the payload negotiated at sync.
         Updates current_packet_count automatically.
         """
-        for i in range(0, self.bin_size, MAX_PAYLOAD):
-            packet = self.raw_bytes[i : i + MAX_PAYLOAD]
+        for i in range(0, self.bin_size, self.chunk_size):
+            packet = self.raw_bytes[i : i + self.chunk_size]
             self.current_packet_count += 1
             yield packet
 
@@ -79,6 +114,8 @@ class CommandFWSendBinInPackets(Command):
         self.bin_fw_update_metadata: BinFWUpdateMetaData = BinFWUpdateMetaData(
             bin_file_path=self.bin_file
         )
+        # chunks flash already holds, sent as a bare offset
+        self.unchanged: set[int] = set()
         print(self.bin_fw_update_metadata)
 
     @property
@@ -94,7 +131,10 @@ class CommandFWSendBinInPackets(Command):
         return CommandIDs.B_CMD_SEND_BIN_IN_PACKETS
 
     def packet(self, metadata: dict = {}) -> Packet:
-        return Packet(id=self.cmd_id.value, payload=list(metadata["bin_bytes"]))
+        payload = list(metadata["bin_bytes"])
+        if "offset" in metadata:
+            payload = list(metadata["offset"].to_bytes(4, byteorder="little")) + payload
+        return Packet(id=self.cmd_id.value, payload=payload)
 
     @property
     def info(self) -> CommandInfo:
@@ -114,20 +154,122 @@ class CommandFWSendBinInPackets(Command):
             response.data["start_address"] = hex(addr)
             response.data["current_packet"] = hex(current)
             response.execution_success = True
+        if response_packet.payload and len(response_packet.payload) >= 12:
+            response.data["pages_skipped"] = int.from_bytes(
+                response_packet.payload[8:12], byteorder="little"
+            )
+        if response_packet.payload and len(response_packet.payload) >= 20:
+            response.data["flash_stats"] = flash_stats(response_packet.payload)
 
         return response
 
-    def cmd(self, pkt: Packet) -> bytearray:
-        """Generate raw byte array to send: id + length + payload + crc (little-endian)"""
-        pkt.crc32 = self.compute_crc32_for_packet(pkt)
-        raw = bytearray([pkt.id & 0xFF, pkt.length & 0xFF])
-        if pkt.length > 0:
-            assert pkt.payload, "Payload can't be None"
-            raw.extend([b & 0xFF for b in pkt.payload])
-        raw.extend(pkt.crc32.to_bytes(4, byteorder="little"))
-        return raw
+    def find_unchanged_chunks(self, port: Serial, first: int) -> set[int]:
+        """
+        Compare the bootloader's CRC of every chunk from `first` on with the
+        image. Empty when the bootloader does not support B_CMD_GET_RANGE_CRC.
+        """
+        meta = self.bin_fw_update_metadata
+        per_request = (protocol_session.max_payload - 1) // RANGE_SIZE
+        unchanged: set[int] = set()
+        for start in range(first, meta.total_packets, per_request):
+            seqs = range(start, min(start + per_request, meta.total_packets))
+            query = CommandGetRangeCRC(
+                ranges=[(s * meta.chunk_size, len(meta.chunk(s))) for s in seqs]
+            )
+            response = query.send_command(
+                port=port, raw_cmd=query.cmd(pkt=query.packet()), show_debug=False
+            )
+            if not response.execution_success:
+                return set()
+            for seq, crc in zip(seqs, response.data["crcs"]):
+                if crc == CRCCalculator.crc32_stm32_style(meta.chunk(seq)):
+                    unchanged.add(seq)
+        return unchanged
+
+    def write_chunk(self, port: Serial, seq: int) -> None:
+        bb = self.bin_fw_update_metadata.chunk(seq)
+        if seq in self.unchanged:
+            bb = b""
+        offset = seq * self.bin_fw_update_metadata.chunk_size
+        raw = self.cmd(pkt=self.packet(metadata={"bin_bytes": bb, "offset": offset}))
+        port.write(protocol_session.frame + raw)
+
+    def send_windowed(self, port: Serial) -> CommandExecutionResponse:
+        """
+        Keep up to `window` chunks in flight. A chunk still missing is resent
+        once a chunk sent after it has been acknowledged, or when replies
+        stop arriving altogether.
+        """
+        response = CommandExecutionResponse()
+        total = self.bin_fw_update_metadata.total_packets
+        window = protocol_session.window
+        # chunks below the resume offset survived an earlier attempt
+        base = protocol_session.resume_offset // self.bin_fw_update_metadata.chunk_size
+        next_seq = base
+        acked: set[int] = set()
+        sent_at: dict[int, float] = {}
+        pages_skipped = 0
+        stats = None
+
+        input("Enter to Start update ? ")
+        self.unchanged = self.find_unchanged_chunks(port, base)
+        print(f"Chunks already in flash, not sent: {len(self.unchanged)}")
+        start = time.time()
+        port.reset_input_buffer()
+
+        while base < total:
+            while next_seq < total and next_seq < base + window:
+                self.write_chunk(port, next_seq)
+                sent_at[next_seq] = time.time()
+                next_seq += 1
+
+            raw = self.receive_raw_packet(port)
+            reply = self.receive_response_packet(bytes(raw)) if raw else None
+            if reply is None:
+                for seq in range(base, next_seq):
+                    if seq not in acked:
+                        self.write_chunk(port, seq)
+                        sent_at[seq] = time.time()
+                continue
+            if reply.id == ResponseType.B_RETRANSMIT.value:
+                # The corrupted chunk shows up as a hole in a later reply
+                continue
+            if not self.is_ack(reply) or not reply.payload:
+                print("[WINDOW] Transfer rejected by bootloader")
+                return response
+
+            cum_offset = int.from_bytes(reply.payload[0:4], byteorder="little")
+            cum = cum_offset // self.bin_fw_update_metadata.chunk_size
+            sack = int.from_bytes(reply.payload[4:8], byteorder="little")
+            if len(reply.payload) >= 12:
+                pages_skipped = int.from_bytes(reply.payload[8:12], byteorder="little")
+            if len(reply.payload) >= 20:
+                stats = flash_stats(reply.payload)
+            acked.update(cum + 1 + i for i in range(SACK_BITS) if sack & (1 << i))
+            if cum > 0:
+                acked.add(cum - 1)
+            latest = max((sent_at[s] for s in acked if s in sent_at), default=0.0)
+            base = max(base, cum)
+            acked = {s for s in acked if s >= base}
+
+            for seq in range(base, next_seq):
+                if seq not in acked and sent_at[seq] < latest:
+                    print(f"[WINDOW] Resending chunk {seq}")
+                    self.write_chunk(port, seq)
+                    sent_at[seq] = time.time()
+
+        elapsed = time.time() - start
+        size = self.bin_fw_update_metadata.bin_size
+        print(f"Total time: {elapsed} ({size / elapsed:.0f} B/s goodput)")
+        print(f"Pages unchanged, not rewritten: {pages_skipped}")
+        print_flash_stats(stats)
+        response.execution_success = True
+        return response
 
     def process_commmand(self, port: Serial) -> CommandExecutionResponse:
+        if protocol_session.windowed:
+            return self.send_windowed(port)
+
         response: CommandExecutionResponse = CommandExecutionResponse()
         response.execution_success = True
         input("Enter to Start update ? ")
@@ -147,4 +289,7 @@ class CommandFWSendBinInPackets(Command):
 
         end = time.time()
         print(f"Total time: {end - start}")
+        if "pages_skipped" in response.data:
+            print(f"Pages unchanged, not rewritten: {response.data['pages_skipped']}")
+        print_flash_stats(response.data.get("flash_stats"))
         return response
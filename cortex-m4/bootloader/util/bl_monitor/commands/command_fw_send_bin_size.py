@@ -1,11 +1,24 @@
 from pathlib import Path
 from typing import Optional
 
-from ..command import Command, CommandExecutionResponse, CommandIDs, CommandInfo, Packet
+from ..command import (
+    PROTOCOL_VERSION_2,
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+    protocol_session,
+)
 from .command_fw_send_bin_in_packets import (
     CommandFWSendBinInPackets,
 )
 
+# AES-CBC-MAC written by fw-signer.py into fota_shared_t.firmware_signature,
+# it keys the bootloader's transfer journal so a cut transfer can resume
+SIGNATURE_OFFSET = 0x10
+SIGNATURE_SIZE = 16
+
 
 class CommandFWSendBinSize(Command):
     def __init__(self) -> None:
@@ -19,6 +32,12 @@ class CommandFWSendBinSize(Command):
             b = f.read()
             return len(b)
 
+    @property
+    def bin_signature(self) -> bytes:
+        with open(self.bin_file, "rb") as f:
+            f.seek(SIGNATURE_OFFSET)
+            return f.read(SIGNATURE_SIZE)
+
     @property
     def next_command(self) -> list["Command"]:
         return [CommandFWSendBinInPackets(bin_file=self.bin_file)]
@@ -32,7 +51,10 @@ class CommandFWSendBinSize(Command):
         print(f"Size of binary file is : {hex(size)}")
         size = size.to_bytes(length=4, byteorder="little")
         print(f"File size: {size}")
-        return Packet(id=self.cmd_id.value, payload=list(size))
+        payload = list(size)
+        if protocol_session.version == PROTOCOL_VERSION_2:
+            payload += list(self.bin_signature)
+        return Packet(id=self.cmd_id.value, payload=payload)
 
     @property
     def info(self) -> CommandInfo:
@@ -60,4 +82,19 @@ class CommandFWSendBinSize(Command):
             response.data["total_packets"] = hex(total)
             response.execution_success = True
 
+        protocol_session.resume_offset = 0
+        if protocol_session.windowed and len(response_packet.payload or []) >= 12:
+            # Windowed chunks leave room for the offset header
+            protocol_session.chunk_size = int.from_bytes(
+                response_packet.payload[8:12], byteorder="little"
+            )
+            print(f"Chunk size: {protocol_session.chunk_size}")
+
+        if len(response_packet.payload or []) >= 16:
+            protocol_session.resume_offset = int.from_bytes(
+                response_packet.payload[12:16], byteorder="little"
+            )
+            if protocol_session.resume_offset:
+                print(f"Resuming at offset 0x{protocol_session.resume_offset:08X}")
+
         return response
@@ -0,0 +1,109 @@
+from serial import Serial
+
+from ..command import (
+    PROTOCOL_VERSION_2,
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+    ResponseType,
+    protocol_session,
+)
+from .command_fw_send_bin_in_packets import CommandFWSendBinInPackets
+from .command_fw_send_bin_size import CommandFWSendBinSize
+from .command_fw_update_sync import CommandFWUpdateSync
+from .command_fw_verify_device_id import CommandFWVerifyDeviceID
+from .command_get_app_version import CommandGetAppVersion
+from .command_get_bootloader_version import CommandGetBootloaderVersion
+
+BATCH_ENTRY_HEADER_SIZE = 4
+
+
+class CommandFWSessionSetup(Command):
+    """
+    Sync, verify device id, both versions and the firmware size in one
+    B_CMD_BATCH round trip. Steps are [id][len LE16][payload], the reply
+    holds [id][ACK/NACK][len LE16][payload] per step the bootloader ran.
+    A bootloader without batch support gets the step by step sequence.
+    """
+
+    def __init__(self) -> None:
+        super().__init__()
+        self.size_step = CommandFWSendBinSize()
+        self.device_id_step = CommandFWVerifyDeviceID()
+        self.steps: list[Command] = []
+
+    @property
+    def cmd_id(self) -> CommandIDs:
+        return CommandIDs.B_CMD_BATCH
+
+    @property
+    def next_command(self) -> list[Command]:
+        return [CommandFWSendBinInPackets(bin_file=self.size_step.bin_file)]
+
+    @property
+    def info(self) -> CommandInfo:
+        return CommandInfo(
+            id=self.cmd_id.value,
+            nemonic="Command FW Session Setup (batched)",
+        )
+
+    def getinput(self) -> None:
+        self.device_id_step.getinput()
+
+    def packet(self, metadata: dict = {}) -> Packet:
+        self.steps = [
+            CommandFWUpdateSync(),
+            self.device_id_step,
+            CommandGetBootloaderVersion(),
+            CommandGetAppVersion(),
+            self.size_step,
+        ]
+        payload: list[int] = []
+        for step in self.steps:
+            pkt = step.packet()
+            payload.append(pkt.id)
+            payload.extend(pkt.length.to_bytes(2, byteorder="little"))
+            payload.extend(pkt.payload or [])
+        return Packet(id=self.cmd_id.value, payload=payload)
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        response = CommandExecutionResponse()
+        if not self.is_ack(response_packet):
+            return response
+
+        payload = bytes(response_packet.payload or [])
+        pos = 0
+        handled = 0
+        while pos + BATCH_ENTRY_HEADER_SIZE <= len(payload) and handled < len(
+            self.steps
+        ):
+            step_id, reply_id = payload[pos], payload[pos + 1]
+            length = int.from_bytes(payload[pos + 2 : pos + 4], byteorder="little")
+            pos += BATCH_ENTRY_HEADER_SIZE
+            reply = Packet(id=reply_id, payload=list(payload[pos : pos + length]))
+            pos += length
+
+            step = self.steps[handled]
+            print(f"[BATCH] {self._get_id_name(step_id)}: {ResponseType(reply_id).name}")
+            if reply_id != ResponseType.B_ACK.value:
+                break
+            response.data[step.cmd_id.name] = step.handle_response(reply).data
+            handled += 1
+
+        response.execution_success = handled == len(self.steps)
+        return response
+
+    def process_commmand(self, port: Serial) -> CommandExecutionResponse:
+        self.getinput()
+        protocol_session.version = PROTOCOL_VERSION_2
+        response = self.send_command(port=port, raw_cmd=self.cmd(pkt=self.packet()))
+        if not response.execution_success:
+            print("[BATCH] Not accepted, running the setup step by step")
+            protocol_session.reset()
+            return CommandFWUpdateSync().process_commmand(port=port)
+
+        for c in self.next_command:
+            response = c.process_commmand(port=port)
+        return response
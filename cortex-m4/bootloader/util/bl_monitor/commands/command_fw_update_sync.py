@@ -1,12 +1,17 @@
 from typing import Optional
 
+from serial import Serial
+
 from ..command import (
+    MAX_PAYLOAD_V2,
+    PROTOCOL_VERSION_2,
+    SYNC_FLAG_WINDOWED,
     Command,
     CommandExecutionResponse,
     CommandIDs,
     CommandInfo,
     Packet,
-    ResponseType,
+    protocol_session,
 )
 from .command_fw_verify_device_id import CommandFWVerifyDeviceID
 
@@ -21,6 +26,13 @@ class CommandFWUpdateSync(Command):
         return CommandIDs.B_CMD_SYNC
 
     def packet(self, metadata: dict = {}) -> Packet:
+        if protocol_session.version == PROTOCOL_VERSION_2:
+            # [ version ][ max payload (LE16) ][ flags ], bootloader answers
+            # with the size and flags both sides support plus its window
+            proposal = [PROTOCOL_VERSION_2]
+            proposal.extend(MAX_PAYLOAD_V2.to_bytes(2, byteorder="little"))
+            proposal.append(SYNC_FLAG_WINDOWED)
+            return Packet(id=self.cmd_id.value, payload=proposal)
         return Packet(id=self.cmd_id.value, length=0)
 
     def getinput(self) -> None:
@@ -33,12 +45,44 @@ class CommandFWUpdateSync(Command):
             nemonic="Command FW Update Sync",
         )
 
-    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+    def process_commmand(self, port: Serial) -> CommandExecutionResponse:
+        self.getinput()
+        # Offer v2 first, a v1-only bootloader never matches the v2 frame
+        # and the request times out
+        protocol_session.version = PROTOCOL_VERSION_2
+        response = self.send_command(port=port, raw_cmd=self.cmd(pkt=self.packet()))
+        if not response.execution_success:
+            print("[SYNC] No v2 answer, falling back to protocol v1")
+            protocol_session.reset()
+            response = self.send_command(
+                port=port, raw_cmd=self.cmd(pkt=self.packet())
+            )
 
-        response = CommandExecutionResponse()
-        if response_packet.payload:
-            response.execution_success = (
-                response_packet.payload[0] == ResponseType.B_ACK.value
+        if response.execution_success:
+            for c in self.next_command:
+                response = c.process_commmand(port=port)
+        return response
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        payload = response_packet.payload
+        if payload and len(payload) >= 3 and payload[0] == PROTOCOL_VERSION_2:
+            protocol_session.max_payload = int.from_bytes(
+                payload[1:3], byteorder="little"
             )
+            protocol_session.chunk_size = protocol_session.max_payload
+            if len(payload) >= 5:
+                protocol_session.flags = payload[3]
+                protocol_session.window = max(payload[4], 1)
+        else:
+            protocol_session.reset()
 
-        return CommandExecutionResponse(execution_success=True)
+        print(
+            f"Protocol v{protocol_session.version}, "
+            f"max payload {protocol_session.max_payload} bytes, "
+            f"window {protocol_session.window if protocol_session.windowed else 1}"
+        )
+        response = CommandExecutionResponse(execution_success=True)
+        response.data["version"] = protocol_session.version
+        response.data["max_payload"] = protocol_session.max_payload
+        response.data["windowed"] = protocol_session.windowed
+        return response
@@ -0,0 +1,72 @@
+from ..command import (
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+)
+
+# Feature flags in the reply
+CAPABILITY_FLAG_RESUME = 0x01
+CAPABILITY_FLAG_FLOW_CONTROL = 0x02
+
+RESPONSE_LENGTH = 12
+# Bitmap of the commands from 0xC0 on appended by newer bootloaders
+EXTENDED_RESPONSE_LENGTH = 14
+
+
+class CommandGetCapabilities(Command):
+    """
+    Reply: [version][window][max payload LE16][max baudrate LE32]
+    [command bitmap LE16, bit n = 0xB0 + n][sync flags][feature flags]
+    [command bitmap LE16, bit n = 0xC0 + n]
+    """
+
+    @property
+    def cmd_id(self) -> CommandIDs:
+        return CommandIDs.B_CMD_GET_CAPABILITIES
+
+    def packet(self, metadata: dict = {}) -> Packet:
+        return Packet(id=self.cmd_id.value, length=0)
+
+    @property
+    def info(self) -> CommandInfo:
+        return CommandInfo(
+            id=self.cmd_id.value,
+            nemonic="Get Capabilities",
+        )
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        response = CommandExecutionResponse()
+        payload = bytes(response_packet.payload or [])
+        response.execution_success = (
+            self.is_ack(response_packet) and len(payload) >= RESPONSE_LENGTH
+        )
+        if not response.execution_success:
+            return response
+
+        bitmap = int.from_bytes(payload[8:10], byteorder="little")
+        if len(payload) >= EXTENDED_RESPONSE_LENGTH:
+            bitmap |= int.from_bytes(payload[12:14], byteorder="little") << 16
+        response.data["protocol_version"] = payload[0]
+        response.data["window"] = payload[1]
+        response.data["max_payload"] = int.from_bytes(payload[2:4], "little")
+        response.data["max_baudrate"] = int.from_bytes(payload[4:8], "little")
+        response.data["commands"] = [
+            self._get_id_name(CommandIDs.B_CMD_RETRANSMIT.value + bit)
+            for bit in range(32)
+            if bitmap & (1 << bit)
+        ]
+        response.data["sync_flags"] = payload[10]
+        response.data["resume"] = bool(payload[11] & CAPABILITY_FLAG_RESUME)
+        response.data["flow_control"] = bool(
+            payload[11] & CAPABILITY_FLAG_FLOW_CONTROL
+        )
+        return response
+
+    def getinput(self) -> None:
+        return
+
+    @property
+    def next_command(self) -> list["Command"]:
+        return []
@@ -1,5 +1,6 @@
 from ..command import (
     Command,
+    CommandExecutionResponse,
     CommandIDs,
     CommandInfo,
     Packet,
@@ -17,7 +18,21 @@ class CommandGetHelp(Command):
             nemonic="Get Supported Commands",
         )
 
+    @property
+    def cmd_id(self) -> CommandIDs:
+        return CommandIDs.B_CMD_GET_HELP
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        response = CommandExecutionResponse()
+        response.execution_success = self.is_ack(response_packet)
+        response.data["commands"] = [
+            self._get_id_name(cmd_id) for cmd_id in response_packet.payload or []
+        ]
+        return response
+
+    def getinput(self) -> None:
+        return
+
     @property
     def next_command(self) -> list["Command"]:
         return []
-
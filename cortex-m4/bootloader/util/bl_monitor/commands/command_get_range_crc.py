@@ -0,0 +1,81 @@
+from ..command import (
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+)
+
+# Request modes
+RANGE_CRC_PAGES = 0
+RANGE_CRC_RANGES = 1
+RANGE_SIZE = 8
+
+
+class CommandGetRangeCRC(Command):
+    """
+    CRC-32/MPEG-2 of the image region in flash.
+    Pages: [0][first page LE16][count LE16] -> [first LE16][count LE16][crc LE32]...
+    Ranges: [1]([image offset LE32][length LE32])... -> [crc LE32]...
+    """
+
+    def __init__(self, ranges: list[tuple[int, int]] | None = None) -> None:
+        super().__init__()
+        self.ranges = ranges
+        self.first_page = 0
+        self.page_count = 0xFFFF
+
+    @property
+    def next_command(self) -> list["Command"]:
+        return []
+
+    @property
+    def cmd_id(self) -> CommandIDs:
+        return CommandIDs.B_CMD_GET_RANGE_CRC
+
+    def packet(self, metadata: dict = {}) -> Packet:
+        if self.ranges is not None:
+            payload = [RANGE_CRC_RANGES]
+            for offset, length in self.ranges:
+                payload += list(offset.to_bytes(4, byteorder="little"))
+                payload += list(length.to_bytes(4, byteorder="little"))
+        else:
+            payload = [RANGE_CRC_PAGES]
+            payload += list(self.first_page.to_bytes(2, byteorder="little"))
+            payload += list(self.page_count.to_bytes(2, byteorder="little"))
+        return Packet(id=self.cmd_id.value, payload=payload)
+
+    @property
+    def info(self) -> CommandInfo:
+        return CommandInfo(
+            id=self.cmd_id.value,
+            nemonic="Get Range CRC",
+        )
+
+    def getinput(self) -> None:
+        if self.ranges is not None:
+            return
+        choice = input(f"First page [{self.first_page}]: ").strip()
+        if choice.isdigit():
+            self.first_page = int(choice)
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        response = CommandExecutionResponse()
+        payload = bytes(response_packet.payload or [])
+        response.execution_success = self.is_ack(response_packet)
+        if not response.execution_success:
+            return response
+
+        if self.ranges is None:
+            first = int.from_bytes(payload[0:2], byteorder="little")
+            response.data["first_page"] = first
+            response.data["count"] = int.from_bytes(payload[2:4], byteorder="little")
+            payload = payload[4:]
+        response.data["crcs"] = [
+            int.from_bytes(payload[i : i + 4], byteorder="little")
+            for i in range(0, len(payload) - 3, 4)
+        ]
+        return response
+
+    def handle_nack(self, packet: Packet):
+        print("Nack received | range outside the image region")
@@ -0,0 +1,84 @@
+import time
+
+from serial import Serial
+
+from ..command import (
+    Command,
+    CommandExecutionResponse,
+    CommandIDs,
+    CommandInfo,
+    Packet,
+)
+
+# Rates the STM32L4 USART (80 MHz PCLK1, 16x oversampling) and common
+# USB-serial bridges both handle
+SUPPORTED_BAUDRATES = (115200, 230400, 460800, 921600, 1000000, 2000000)
+DEFAULT_BAUDRATE = 921600
+
+
+class CommandSetBaudrate(Command):
+    def __init__(self, baudrate: int = DEFAULT_BAUDRATE) -> None:
+        super().__init__()
+        self.baudrate = baudrate
+
+    @property
+    def next_command(self) -> list["Command"]:
+        return []
+
+    @property
+    def cmd_id(self) -> CommandIDs:
+        return CommandIDs.B_CMD_SET_BAUDRATE
+
+    def packet(self, metadata: dict = {}) -> Packet:
+        return Packet(
+            id=self.cmd_id.value,
+            payload=list(self.baudrate.to_bytes(4, byteorder="little")),
+        )
+
+    @property
+    def info(self) -> CommandInfo:
+        return CommandInfo(
+            id=self.cmd_id.value,
+            nemonic="Set Baudrate",
+        )
+
+    def getinput(self) -> None:
+        choice = input(f"Baudrate {SUPPORTED_BAUDRATES} [{self.baudrate}]: ").strip()
+        if choice.isdigit():
+            self.baudrate = int(choice)
+
+    def handle_response(self, response_packet: Packet) -> CommandExecutionResponse:
+        response = CommandExecutionResponse()
+        response.execution_success = self.is_ack(response_packet)
+        if response_packet.payload and len(response_packet.payload) >= 4:
+            response.data["baudrate"] = int.from_bytes(
+                response_packet.payload[0:4], byteorder="little"
+            )
+        return response
+
+    def process_commmand(self, port: Serial) -> CommandExecutionResponse:
+        """
+        The ACK comes back at the old rate, then both sides switch and the
+        same request is repeated at the new rate as confirmation. Without an
+        ACK to it the bootloader falls back on its own, so the host does too.
+        """
+        self.getinput()
+        old_baudrate = port.baudrate
+        response = self.send_command(port=port, raw_cmd=self.cmd(pkt=self.packet()))
+        if not response.execution_success:
+            print(f"[BAUD] {self.baudrate} rejected, staying at {old_baudrate}")
+            return response
+
+        port.flush()
+        port.baudrate = self.baudrate
+        response = self.send_command(port=port, raw_cmd=self.cmd(pkt=self.packet()))
+        if response.execution_success:
+            print(f"[BAUD] Link running at {self.baudrate}")
+            return response
+
+        print(f"[BAUD] No confirmation at {self.baudrate}, back to {old_baudrate}")
+        port.baudrate = old_baudrate
+        # let the bootloader's trial window run out before the next request
+        time.sleep(1)
+        port.reset_input_buffer()
+        return response
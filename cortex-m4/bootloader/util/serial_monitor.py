@@ -3,15 +3,19 @@ from typing import Optional
 from bl_monitor import (
     Command,
     CommandFWSendBinSize,
+    CommandFWSessionSetup,
     CommandFWUpdateSync,
     CommandFWVerifyDeviceID,
     CommandGetAppVersion,
     CommandGetBootloaderVersion,
+    CommandGetCapabilities,
     CommandGetChipID,
     CommandGetHelp,
+    CommandGetRangeCRC,
     CommandGetRDPLevel,
     CommandJumpToAddress,
     CommandRetransmit,
+    CommandSetBaudrate,
     Packet,
     ResponseType,
 )
@@ -23,6 +27,8 @@ from serial.tools import list_ports
 # ============================================================================
 
 BAUDRATE = 115200
+# Must match a bootloader built with BOOTLOADER_UART_FLOW_CONTROL
+FLOW_CONTROL = False
 KEYWORD = "STM"  # Changed: More generic to match more devices
 TIMEOUT = 5
 
@@ -38,6 +44,11 @@ class SerialMonitor:
             5: CommandFWUpdateSync(),
             6: CommandFWVerifyDeviceID(),
             7: CommandFWSendBinSize(),
+            8: CommandSetBaudrate(),
+            9: CommandGetHelp(),
+            10: CommandGetCapabilities(),
+            11: CommandFWSessionSetup(),
+            12: CommandGetRangeCRC(),
         }
 
     def scan_com_ports(self) -> Optional[Serial]:
@@ -60,7 +71,12 @@ class SerialMonitor:
                 print(f"\n[SCAN] ✓ Matched device: {port_info.device}")
                 print(f"[SCAN]   Description: {port_info.description}")
                 try:
-                    return Serial(port_info.device, BAUDRATE, timeout=TIMEOUT)
+                    return Serial(
+                        port_info.device,
+                        BAUDRATE,
+                        timeout=TIMEOUT,
+                        rtscts=FLOW_CONTROL,
+                    )
                 except Exception as e:
                     print(f"[SCAN] ERROR: Failed to open {port_info.device}: {e}")
                     continue
@@ -75,7 +91,12 @@ class SerialMonitor:
             selected_port = available_ports[int(choice) - 1]
             print(f"[SCAN] Manually selected: {selected_port.device}")
             try:
-                return Serial(selected_port.device, BAUDRATE, timeout=TIMEOUT)
+                return Serial(
+                    selected_port.device,
+                    BAUDRATE,
+                    timeout=TIMEOUT,
+                    rtscts=FLOW_CONTROL,
+                )
             except Exception as e:
                 print(f"[SCAN] ERROR: Failed to open {selected_port.device}: {e}")
 
@@ -92,8 +113,9 @@ class SerialMonitor:
             if not self.port.is_open:
                 self.port.open()
                 print(f"[CONNECT] ✓ Port opened: {self.port.name}")
-                print(f"[CONNECT]   Baudrate: {BAUDRATE}")
+                print(f"[CONNECT]   Baudrate: {self.port.baudrate}")
                 print(f"[CONNECT]   Timeout: {TIMEOUT}s")
+                print(f"[CONNECT]   RTS/CTS: {FLOW_CONTROL}")
 
             return True
         except Exception as e:
@@ -8,26 +8,37 @@
 #include "stm32l4xx_hal_flash.h"
 
 #define BOOTLOADER_SISE 0x10000U
-#define FOTA_SHARED_START (FLASH_BASE + BOOTLOADER_SISE)
+
+/* The image lives in bank 2, away from the bootloader in bank 1, so the
+ * bootloader keeps fetching code while the image is erased or programmed.
+ * Page numbers below count from the start of their bank */
+#define FLASH_BANK2_START (FLASH_BASE + 0x80000U)
+
+#define FOTA_SHARED_START FLASH_BANK2_START
 #define FOTA_SHARED_SIZE 0x800
-#define FLASH_SECTOR_APP_START_ADDRESS \
-	(FLASH_BASE + BOOTLOADER_SISE + FOTA_SHARED_SIZE)
+#define FLASH_SECTOR_APP_START_ADDRESS (FOTA_SHARED_START + FOTA_SHARED_SIZE)
 
 #define FOTA_SHARED_REGION __attribute__((section(".API_SHARED")))
 
-/* Shared region: page 32, 1 page */
-#define FOTA_SHARED_PAGE 32
+/* Shared region: bank 2 page 0, 1 page */
+#define FOTA_SHARED_PAGE 0
 #define FOTA_SHARED_NBPAGES 1
-#define FOTA_SHARED_BANK FLASH_BANK_1
+#define FOTA_SHARED_BANK FLASH_BANK_2
 
-/* App region: page 33, 128 pages */
-#define FOTA_APP_PAGE 33
+/* App region: bank 2 page 1, 128 pages */
+#define FOTA_APP_PAGE 1
 #define FOTA_APP_NBPAGES 128
-#define FOTA_APP_BANK FLASH_BANK_1
+#define FOTA_APP_BANK FLASH_BANK_2
 
-/* Shared + App region: page 32, 129 pages */
-#define FOTA_SHARED_APP_PAGE 32
+/* Shared + App region: bank 2 page 0, 129 pages */
+#define FOTA_SHARED_APP_PAGE 0
 #define FOTA_SHARED_APP_NBPAGES 129
-#define FOTA_SHARED_APP_BANK FLASH_BANK_1
+#define FOTA_SHARED_APP_BANK FLASH_BANK_2
+
+/* Transfer journal: bank 2 page 129, 1 page right after the app region */
+#define FOTA_JOURNAL_PAGE 129
+#define FOTA_JOURNAL_BANK FLASH_BANK_2
+#define FOTA_JOURNAL_START \
+	(FLASH_BANK2_START + (FOTA_JOURNAL_PAGE * FLASH_PAGE_SIZE))
 
 #endif // _INC_FLASH_H__
@@ -1,20 +1,46 @@
 #ifndef __RING_BUFFER_IS_RINGBUFFER_H_
 #define __RING_BUFFER_IS_RINGBUFFER_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+/* Single producer, single consumer. The producer only stores write_index and
+ * the consumer only stores read_index, each with release ordering, so the
+ * bytes are visible before the index that publishes them (a DMB on
+ * Cortex-M4). One slot is kept free to tell full from empty. */
 typedef struct ring_buffer {
 	uint8_t *buffer;
 	uint32_t mask;
-	uint32_t read_index;
-	uint32_t write_index;
+	atomic_uint_least32_t read_index;
+	atomic_uint_least32_t write_index;
 } ring_buffer_t;
 
 void ring_buffer_setup(ring_buffer_t *rb, uint8_t *buffer, uint32_t size);
+/* Not safe against a running producer or consumer */
+void ring_buffer_reset(ring_buffer_t *rb);
 bool ring_buffer_empty(ring_buffer_t *rb);
-bool ring_buffer_write(ring_buffer_t *rb, uint8_t byte);
+uint32_t ring_buffer_count(const ring_buffer_t *rb);
+uint32_t ring_buffer_free(const ring_buffer_t *rb);
+
+/* Consumer side */
 bool ring_buffer_read(ring_buffer_t *rb, uint8_t *byte);
+uint32_t ring_buffer_read_bulk(ring_buffer_t *rb, uint8_t *data,
+			       uint32_t length);
+bool ring_buffer_peek(const ring_buffer_t *rb, uint32_t offset,
+		      uint8_t *byte);
+uint32_t ring_buffer_readable_span(const ring_buffer_t *rb,
+				   const uint8_t **span);
+void ring_buffer_read_commit(ring_buffer_t *rb, uint32_t length);
+
+/* Producer side */
+bool ring_buffer_write(ring_buffer_t *rb, uint8_t byte);
+uint32_t ring_buffer_write_bulk(ring_buffer_t *rb, const uint8_t *data,
+				uint32_t length);
+uint32_t ring_buffer_writable_span(const ring_buffer_t *rb, uint8_t **span);
+void ring_buffer_write_commit(ring_buffer_t *rb, uint32_t length);
+/* For a producer that fills the storage on its own (circular DMA) */
+void ring_buffer_write_index_set(ring_buffer_t *rb, uint32_t index);
 
 #if defined(__ARM_ARCH_6M__) && defined(__ARM_ARCH_7M__) &&           \
 	defined(__ARM_ARCH_7EM__) && defined(__ARM_ARCH_8M_BASE__) && \
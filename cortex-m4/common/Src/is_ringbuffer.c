@@ -1,5 +1,7 @@
 #include "is_ringbuffer.h"
 
+#include <string.h>
+
 #if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_7M__) ||           \
 	defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_BASE__) || \
 	defined(__ARM_ARCH_8M_MAIN__)
@@ -7,46 +9,152 @@
 #include <stdio.h>
 #endif
 
+/* The side owning an index reads it relaxed, the other side's index is
+ * loaded with acquire so the data behind it is seen */
+#define RB_OWN(idx) atomic_load_explicit(&(idx), memory_order_relaxed)
+#define RB_OTHER(idx) atomic_load_explicit(&(idx), memory_order_acquire)
+#define RB_PUBLISH(idx, value) \
+	atomic_store_explicit(&(idx), (value), memory_order_release)
+
 void ring_buffer_setup(ring_buffer_t *rb, uint8_t *buffer, uint32_t size)
 {
 	rb->buffer = buffer;
-	rb->read_index = 0;
-	rb->write_index = 0;
+	atomic_init(&rb->read_index, 0U);
+	atomic_init(&rb->write_index, 0U);
 
 	/* Assumes size is power of 2*/
 	rb->mask = size - 1;
 }
+void ring_buffer_reset(ring_buffer_t *rb)
+{
+	RB_PUBLISH(rb->read_index, 0U);
+	RB_PUBLISH(rb->write_index, 0U);
+}
 bool ring_buffer_empty(ring_buffer_t *rb)
 {
-	return rb->read_index == rb->write_index;
+	return ring_buffer_count(rb) == 0U;
+}
+uint32_t ring_buffer_count(const ring_buffer_t *rb)
+{
+	ring_buffer_t *const r = (ring_buffer_t *)rb;
+	uint32_t read_index = RB_OTHER(r->read_index);
+	uint32_t write_index = RB_OTHER(r->write_index);
+
+	return (write_index - read_index) & rb->mask;
 }
+uint32_t ring_buffer_free(const ring_buffer_t *rb)
+{
+	return rb->mask - ring_buffer_count(rb);
+}
+
 bool ring_buffer_read(ring_buffer_t *rb, uint8_t *byte)
 {
-	uint32_t localreadindex = rb->read_index;
-	uint32_t localwriteindex = rb->write_index;
-	if (localreadindex == localwriteindex) {
+	return ring_buffer_read_bulk(rb, byte, 1U) == 1U;
+}
+bool ring_buffer_peek(const ring_buffer_t *rb, uint32_t offset, uint8_t *byte)
+{
+	ring_buffer_t *const r = (ring_buffer_t *)rb;
+	uint32_t read_index = RB_OWN(r->read_index);
+	uint32_t write_index = RB_OTHER(r->write_index);
+
+	if (offset >= ((write_index - read_index) & rb->mask)) {
 		return false;
 	}
-	*byte = rb->buffer[localreadindex];
-	localreadindex = (localreadindex + 1) & rb->mask;
-	rb->read_index = localreadindex;
+	*byte = rb->buffer[(read_index + offset) & rb->mask];
 	return true;
 }
-bool ring_buffer_write(ring_buffer_t *rb, uint8_t byte)
+uint32_t ring_buffer_readable_span(const ring_buffer_t *rb,
+				   const uint8_t **span)
+{
+	ring_buffer_t *const r = (ring_buffer_t *)rb;
+	uint32_t read_index = RB_OWN(r->read_index);
+	uint32_t write_index = RB_OTHER(r->write_index);
+
+	*span = &rb->buffer[read_index];
+	if (write_index >= read_index) {
+		return write_index - read_index;
+	}
+	/* Wrapped, the span ends at the end of the storage */
+	return rb->mask + 1U - read_index;
+}
+void ring_buffer_read_commit(ring_buffer_t *rb, uint32_t length)
+{
+	uint32_t read_index = RB_OWN(rb->read_index);
+
+	RB_PUBLISH(rb->read_index, (read_index + length) & rb->mask);
+}
+uint32_t ring_buffer_read_bulk(ring_buffer_t *rb, uint8_t *data,
+			       uint32_t length)
 {
-	uint32_t localreadindex = rb->read_index;
-	uint32_t localwriteindex = rb->write_index;
+	uint32_t bytes_read = 0;
 
-	uint32_t next_write_index = (localwriteindex + 1) & rb->mask;
+	/* At most two spans, before and after the wrap */
+	while (bytes_read < length) {
+		const uint8_t *span;
+		uint32_t span_length = ring_buffer_readable_span(rb, &span);
 
+		if (span_length == 0U) {
+			break;
+		}
+		if (span_length > (length - bytes_read)) {
+			span_length = length - bytes_read;
+		}
+		memcpy(&data[bytes_read], span, span_length);
+		ring_buffer_read_commit(rb, span_length);
+		bytes_read += span_length;
+	}
+	return bytes_read;
+}
+
+bool ring_buffer_write(ring_buffer_t *rb, uint8_t byte)
+{
 	/* Drop latest data because buffer is full*/
-	if (next_write_index == localreadindex) {
-		return false;
+	return ring_buffer_write_bulk(rb, &byte, 1U) == 1U;
+}
+uint32_t ring_buffer_writable_span(const ring_buffer_t *rb, uint8_t **span)
+{
+	ring_buffer_t *const r = (ring_buffer_t *)rb;
+	uint32_t read_index = RB_OTHER(r->read_index);
+	uint32_t write_index = RB_OWN(r->write_index);
+
+	*span = &rb->buffer[write_index];
+	if (write_index >= read_index) {
+		/* Up to the end of the storage, keeping the free slot when
+		 * the reader sits at the start */
+		return rb->mask + 1U - write_index - (read_index == 0U ? 1U : 0U);
 	}
+	return read_index - write_index - 1U;
+}
+void ring_buffer_write_commit(ring_buffer_t *rb, uint32_t length)
+{
+	uint32_t write_index = RB_OWN(rb->write_index);
 
-	rb->buffer[localwriteindex] = byte;
-	rb->write_index = next_write_index;
-	return true;
+	RB_PUBLISH(rb->write_index, (write_index + length) & rb->mask);
+}
+void ring_buffer_write_index_set(ring_buffer_t *rb, uint32_t index)
+{
+	RB_PUBLISH(rb->write_index, index & rb->mask);
+}
+uint32_t ring_buffer_write_bulk(ring_buffer_t *rb, const uint8_t *data,
+				uint32_t length)
+{
+	uint32_t written = 0;
+
+	while (written < length) {
+		uint8_t *span;
+		uint32_t span_length = ring_buffer_writable_span(rb, &span);
+
+		if (span_length == 0U) {
+			break;
+		}
+		if (span_length > (length - written)) {
+			span_length = length - written;
+		}
+		memcpy(span, &data[written], span_length);
+		ring_buffer_write_commit(rb, span_length);
+		written += span_length;
+	}
+	return written;
 }
 
 #if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_7M__) ||           \
@@ -55,13 +163,10 @@ bool ring_buffer_write(ring_buffer_t *rb, uint8_t byte)
 #else
 void ring_buffer_print(const ring_buffer_t *rb)
 {
-	uint32_t r = rb->read_index;
-	uint32_t w = rb->write_index;
+	uint8_t c;
 
-	while (r != w) {
-		uint8_t c = rb->buffer[r & rb->mask];
+	for (uint32_t i = 0; ring_buffer_peek(rb, i, &c); i++) {
 		printf("%02X ", c);
-		r++;
 	}
 	printf("\n");
 }
@@ -0,0 +1,271 @@
+/*
+ * The comms parser (bootloader comms.c, crc.c against mock_hal.c) fed the
+ * same stream of v1 and v2 packets two ways: one comm_fsm_dispatch() per
+ * byte, as the UART interrupt did before user-001, and comm_process_bytes()
+ * over the 512 byte spans the RX DMA hands over. A second stream puts line
+ * noise and false starts of the sync word between the packets, and is also
+ * parsed in spans of 1 to 8 bytes so the sync word is split at every
+ * offset. Every packet has to come out of the queue valid and intact on
+ * every path, otherwise the run fails; the timings are for reading.
+ */
+#include "bootloader_fsm.h"
+#include "comms.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define STREAM_SIZE (256U * 1024U)
+#define STREAM_MAX_PACKETS (STREAM_SIZE / 10U)
+#define SPAN_SIZE 512U
+#define ROUNDS 10U
+#define PACKET_COMMAND_ID 0xB6U
+
+extern Event byte_received_event;
+extern Event init_event;
+
+typedef struct expected_packet {
+	uint32_t payload;
+	uint16_t length;
+	uint8_t version;
+} expected_packet_t;
+
+static uint8_t stream[STREAM_SIZE];
+static uint32_t stream_length;
+static expected_packet_t expected[STREAM_MAX_PACKETS];
+static uint32_t expected_count;
+
+/* Packets taken from the queue in the current pass, and those that were
+ * not the expected one */
+static uint32_t received;
+static uint32_t mismatches;
+
+static bootloader_fsm_t parser;
+
+static uint32_t lcg_seed = 1U;
+
+static uint32_t lcg_next(void)
+{
+	lcg_seed = (lcg_seed * 1103515245U) + 12345U;
+	return lcg_seed >> 16;
+}
+
+/* One packet at the end of the stream: a v1 packet with up to 16 bytes or
+ * a v2 packet of whole double words, CRC over id, length and payload */
+static void stream_put_packet(const uint8_t version)
+{
+	uint8_t *s = &stream[stream_length];
+	uint32_t i = 0U;
+	uint32_t crc_start;
+	uint32_t crc;
+	uint16_t length;
+
+	if (version == PROTOCOL_VERSION_2) {
+		length = (uint16_t)(8U * (1U + (lcg_next() % 64U)));
+	} else {
+		length = (uint16_t)(lcg_next() % (MAX_PAYLOAD_SIZE_V1 + 1U));
+	}
+	s[i++] = 0xA5U;
+	s[i++] = 0xAAU;
+	s[i++] = 0xBBU;
+	s[i++] = (version == PROTOCOL_VERSION_2) ? 0xA6U : 0xA5U;
+	crc_start = i;
+	s[i++] = PACKET_COMMAND_ID;
+	s[i++] = (uint8_t)length;
+	if (version == PROTOCOL_VERSION_2) {
+		s[i++] = (uint8_t)(length >> 8);
+	}
+	expected[expected_count] =
+		(expected_packet_t){ .payload = stream_length + i,
+				     .length = length,
+				     .version = version };
+	for (uint16_t k = 0U; k < length; k++) {
+		s[i++] = (uint8_t)lcg_next();
+	}
+	crc = stm32_crc32_accumulate(STM32_CRC32_INIT, &s[crc_start],
+				     i - crc_start);
+	memcpy(&s[i], &crc, sizeof(crc));
+	i += sizeof(crc);
+	stream_length += i;
+	expected_count++;
+}
+
+/* Starts of the sync word that a packet follows directly. The matcher has
+ * to fall back into the real one, e.g. A5 A5 AA BB A5 or A5 AA A5 AA BB
+ * A5. A5 AA BB is left out, with A5 from the real word it is a sync word. */
+static const struct false_start {
+	uint8_t bytes[4];
+	uint8_t length;
+} false_starts[] = {
+	{ { 0xA5U }, 1U },
+	{ { 0xA5U, 0xA5U }, 2U },
+	{ { 0xA5U, 0xAAU }, 2U },
+	{ { 0xA5U, 0xAAU, 0xA5U }, 3U },
+	{ { 0xA5U, 0xAAU, 0xBBU, 0xA7U }, 4U },
+	{ { 0xA5U, 0xAAU, 0xBBU, 0xA4U }, 4U },
+};
+
+#define FALSE_STARTS (sizeof(false_starts) / sizeof(false_starts[0]))
+
+/* Up to 32 random bytes that never start a sync word, then maybe a false
+ * start */
+static uint32_t stream_put_noise(void)
+{
+	uint32_t noise = lcg_next() % 33U;
+	uint32_t pick = lcg_next() % (2U * FALSE_STARTS);
+
+	for (uint32_t i = 0U; i < noise; i++) {
+		uint8_t b = (uint8_t)lcg_next();
+		stream[stream_length++] = (b == 0xA5U) ? 0x5AU : b;
+	}
+	if (pick < FALSE_STARTS) {
+		memcpy(&stream[stream_length], false_starts[pick].bytes,
+		       false_starts[pick].length);
+		stream_length += false_starts[pick].length;
+		noise += false_starts[pick].length;
+	}
+	return noise;
+}
+
+/* Returns the noise bytes put between the packets */
+static uint32_t stream_build(const bool noisy)
+{
+	uint32_t noise = 0U;
+
+	stream_length = 0U;
+	expected_count = 0U;
+	while (stream_length < (STREAM_SIZE - 600U)) {
+		if (noisy) {
+			noise += stream_put_noise();
+		}
+		stream_put_packet((expected_count % 3U) == 0U ?
+					  PROTOCOL_VERSION_1 :
+					  PROTOCOL_VERSION_2);
+	}
+	return noise;
+}
+
+/* Take every queued packet and check it against the stream */
+static void queue_drain(void)
+{
+	EventSignals status;
+	comms_packet_t *packet;
+
+	while ((packet = comm_queue_front(&status)) != NULL) {
+		const expected_packet_t *want =
+			&expected[received < expected_count ? received : 0U];
+
+		if ((received >= expected_count) ||
+		    (status != SIGNAL_PACKET_VALID) ||
+		    (packet->command_id != PACKET_COMMAND_ID) ||
+		    (packet->version != want->version) ||
+		    (packet->length != want->length) ||
+		    (memcmp(packet->payload, &stream[want->payload],
+			    want->length) != 0)) {
+			mismatches++;
+		}
+		received++;
+		comm_queue_pop();
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((double)t.tv_sec * 1e9) + (double)t.tv_nsec;
+}
+
+/* Drained every 8 bytes: a full queue drops bytes on this path and no
+ * packet is shorter than 10 */
+static double run_per_byte(void)
+{
+	double start = now_ns();
+
+	received = 0U;
+	for (uint32_t i = 0U; i < stream_length; i++) {
+		parser.uart_byte = stream[i];
+		comm_fsm_dispatch(&parser, &byte_received_event);
+		if ((i % 8U) == 7U) {
+			queue_drain();
+		}
+	}
+	queue_drain();
+	return now_ns() - start;
+}
+
+/* A full queue stops the span parser, the rest of the span waits in the
+ * ring until a slot is free */
+static double run_spans(const uint32_t span)
+{
+	double start = now_ns();
+
+	received = 0U;
+	for (uint32_t pos = 0U; pos < stream_length;) {
+		uint32_t n = stream_length - pos;
+		uint32_t done = 0U;
+
+		n = n < span ? n : span;
+		while (done < n) {
+			done += comm_process_bytes(&parser, &stream[pos + done],
+						   n - done);
+			queue_drain();
+		}
+		pos += n;
+	}
+	return now_ns() - start;
+}
+
+/* Returns the packets missing over all rounds */
+static uint32_t stream_bench(const char *const name)
+{
+	double per_byte_best = 1e18;
+	double spans_best = 1e18;
+	uint32_t lost = 0U;
+
+	for (uint32_t round = 0U; round < ROUNDS; round++) {
+		double t = run_per_byte();
+		per_byte_best = t < per_byte_best ? t : per_byte_best;
+		lost += expected_count - received;
+		t = run_spans(SPAN_SIZE);
+		spans_best = t < spans_best ? t : spans_best;
+		lost += expected_count - received;
+	}
+
+	printf("%s: per-byte dispatch  %.2f ns/byte, %.0f ns/packet\n", name,
+	       per_byte_best / stream_length, per_byte_best / expected_count);
+	printf("%s: comm_process_bytes %.2f ns/byte, %.0f ns/packet (%.1fx)\n",
+	       name, spans_best / stream_length, spans_best / expected_count,
+	       per_byte_best / spans_best);
+	return lost;
+}
+
+int main(void)
+{
+	uint32_t lost = 0U;
+	uint32_t noise;
+
+	comm_fsm_init(&parser, &init_event);
+
+	(void)stream_build(false);
+	printf("clean: %u bytes, %u packets\n", stream_length,
+	       expected_count);
+	lost += stream_bench("clean");
+
+	noise = stream_build(true);
+	printf("noisy: %u bytes, %u packets, %u bytes of noise\n",
+	       stream_length, expected_count, noise);
+	lost += stream_bench("noisy");
+	/* Sync word and false starts split across span boundaries */
+	for (uint32_t span = 1U; span <= 8U; span++) {
+		(void)run_spans(span);
+		lost += expected_count - received;
+	}
+
+	if ((mismatches != 0U) || (lost != 0U)) {
+		printf("%u packet(s) wrong, %u missing\n", mismatches, lost);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Per event cost of the X-macro FSM engine in sm_common.h against the
+ * function pointer engine it replaced (Fsm_ctor/Fsm_init/Fsm_dispatch, kept
+ * here as legacy_*). Both run the same handlers, bench_fsm_states.h, over
+ * the same byte stream, one dispatch per byte. The run fails only if a
+ * machine miscounts frames; the timings are for reading, so compare them
+ * on one machine and build type.
+ */
+#include "sm_common.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define STREAM_SIZE (256U * 1024U)
+#define ROUNDS 20U
+
+static const uint8_t bench_sync[4] = { 0xA5U, 0xAAU, 0xBBU, 0xA5U };
+
+static const Event bench_init_event = { SIGNAL_INIT };
+static const Event bench_entry_event = { SIGNAL_ENTRY };
+static const Event bench_exit_event = { SIGNAL_EXIT };
+static const Event bench_byte_event = { SIGNAL_BYTE_RECEIVED };
+
+/* The engine before user-019: the state is its handler, a flat machine */
+typedef status_t (*legacy_handler_t)(void *const me, Event const *const e);
+
+typedef struct legacy_fsm {
+	legacy_handler_t state;
+	legacy_handler_t super_state;
+} legacy_fsm_t;
+
+typedef struct legacy_parser {
+	legacy_fsm_t fsm;
+	uint8_t byte;
+	uint8_t index;
+	uint8_t length;
+	uint8_t count;
+	uint8_t sum;
+	uint32_t frames;
+	uint32_t errors;
+} legacy_parser_t;
+
+static void legacy_init(legacy_fsm_t *const me, Event const *const e)
+{
+	assert(me->state != NULL);
+	(*me->state)(me, e);
+	(*me->state)(me, &bench_entry_event);
+}
+
+/* Out of line, as it was in sm_common.c */
+static __attribute__((noinline)) void legacy_dispatch(legacy_fsm_t *const me,
+						      Event const *const e)
+{
+	status_t status;
+	legacy_handler_t prev = me->state;
+	status = (*me->state)(me, e);
+
+	if (status == STATE_TRANSITION) {
+		(prev)(me, &bench_exit_event);
+		(*me->state)(me, &bench_entry_event);
+	}
+}
+
+#define BENCH_STATE(state_) legacy_##state_
+#define BENCH_TRANSIT(state_) \
+	(me->fsm.state = (legacy_handler_t)legacy_##state_, STATE_TRANSITION)
+#define BENCH_PARSER legacy_parser_t
+#include "bench_fsm_states.h"
+#undef BENCH_STATE
+#undef BENCH_TRANSIT
+#undef BENCH_PARSER
+
+/* The same machine through FSM_DECLARE/FSM_DEFINE */
+typedef struct engine_parser {
+	Fsm fsm;
+	uint8_t byte;
+	uint8_t index;
+	uint8_t length;
+	uint8_t count;
+	uint8_t sum;
+	uint32_t frames;
+	uint32_t errors;
+} engine_parser_t;
+
+#define ENGINE_STATES(X)            \
+	X(engine_wait_sync, fsm_top) \
+	X(engine_preamble, fsm_top)  \
+	X(engine_length, fsm_top)    \
+	X(engine_payload, fsm_top)   \
+	X(engine_check, fsm_top)
+
+FSM_DECLARE(engine, ENGINE_STATES);
+
+#define BENCH_STATE(state_) engine_##state_
+#define BENCH_TRANSIT(state_) FSM_TRANSIT_TO(engine_##state_)
+#define BENCH_PARSER engine_parser_t
+#include "bench_fsm_states.h"
+#undef BENCH_STATE
+#undef BENCH_TRANSIT
+#undef BENCH_PARSER
+
+/* Dispatch is called from another file on target, keep it a real call */
+void engine_init(engine_parser_t *const me, Event const *const e);
+void engine_dispatch(engine_parser_t *const me, Event const *const e)
+	__attribute__((noinline));
+
+FSM_DEFINE(engine, engine_parser_t, ENGINE_STATES, engine_wait_sync)
+
+static uint8_t stream[STREAM_SIZE];
+static uint32_t stream_length;
+static uint32_t stream_frames;
+static uint32_t stream_errors;
+
+static uint32_t lcg_seed = 1U;
+
+static uint8_t lcg_next(void)
+{
+	lcg_seed = (lcg_seed * 1103515245U) + 12345U;
+	return (uint8_t)(lcg_seed >> 16);
+}
+
+/* Frames with noise between them, a corrupted sum now and then and false
+ * sync starts that make the preamble state re-enter itself */
+static void stream_build(void)
+{
+	uint32_t n = 0U;
+
+	while (stream_length < (STREAM_SIZE - 64U)) {
+		uint8_t *s = &stream[stream_length];
+		uint32_t i = 0U;
+		uint8_t length = lcg_next() & 0x0FU;
+		uint8_t sum = 0U;
+
+		for (uint8_t noise = lcg_next() % 4U; noise > 0U; noise--) {
+			uint8_t b = lcg_next();
+			s[i++] = (b == bench_sync[0]) ? 0U : b;
+		}
+		if ((n % 16U) == 0U) {
+			s[i++] = 0xA5U;
+			s[i++] = 0xAAU;
+		}
+		memcpy(&s[i], bench_sync, sizeof(bench_sync));
+		i += sizeof(bench_sync);
+		s[i++] = length;
+		for (uint8_t k = 0U; k < length; k++) {
+			s[i] = lcg_next();
+			sum = (uint8_t)(sum + s[i++]);
+		}
+		if ((n % 8U) == 7U) {
+			s[i++] = (uint8_t)(sum + 1U);
+			stream_errors++;
+		} else {
+			s[i++] = sum;
+			stream_frames++;
+		}
+		stream_length += i;
+		n++;
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((double)t.tv_sec * 1e9) + (double)t.tv_nsec;
+}
+
+static double run_legacy(legacy_parser_t *const p)
+{
+	double start;
+
+	memset(p, 0, sizeof(*p));
+	p->fsm.state = (legacy_handler_t)legacy_wait_sync;
+	legacy_init(&p->fsm, &bench_init_event);
+	start = now_ns();
+	for (uint32_t i = 0U; i < stream_length; i++) {
+		p->byte = stream[i];
+		legacy_dispatch(&p->fsm, &bench_byte_event);
+	}
+	return now_ns() - start;
+}
+
+static double run_engine(engine_parser_t *const p)
+{
+	double start;
+
+	memset(p, 0, sizeof(*p));
+	engine_init(p, &bench_init_event);
+	start = now_ns();
+	for (uint32_t i = 0U; i < stream_length; i++) {
+		p->byte = stream[i];
+		engine_dispatch(p, &bench_byte_event);
+	}
+	return now_ns() - start;
+}
+
+int main(void)
+{
+	legacy_parser_t legacy;
+	engine_parser_t engine;
+	double legacy_best = 1e18;
+	double engine_best = 1e18;
+	int failures = 0;
+
+	stream_build();
+	/* Alternate the two and keep the best round of each, so both see the
+	 * same caches and clock */
+	for (uint32_t round = 0U; round < ROUNDS; round++) {
+		double t = run_legacy(&legacy);
+		legacy_best = t < legacy_best ? t : legacy_best;
+		t = run_engine(&engine);
+		engine_best = t < engine_best ? t : engine_best;
+
+		if ((legacy.frames != stream_frames) ||
+		    (legacy.errors != stream_errors) ||
+		    (engine.frames != stream_frames) ||
+		    (engine.errors != stream_errors)) {
+			failures++;
+		}
+	}
+
+	printf("%u events, %u frames, %u bad sums\n", stream_length,
+	       stream_frames, stream_errors);
+	printf("legacy Fsm_dispatch: %.2f ns/event\n",
+	       legacy_best / stream_length);
+	printf("FSM_DEFINE dispatch: %.2f ns/event (%+.1f%%)\n",
+	       engine_best / stream_length,
+	       ((engine_best / legacy_best) - 1.0) * 100.0);
+	if (failures != 0) {
+		printf("frames miscounted in %d round(s): legacy %u/%u, "
+		       "FSM_DEFINE %u/%u\n",
+		       failures, legacy.frames, legacy.errors, engine.frames,
+		       engine.errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Handlers of the benchmark frame parser, included once per engine so both
+ * run the same code. The includer defines
+ *	BENCH_STATE(state_)	name of the handler of a state
+ *	BENCH_TRANSIT(state_)	statement value moving to a state
+ *	BENCH_PARSER		the parser type, its engine state first
+ * No include guard on purpose.
+ *
+ * Frames are A5 AA BB A5 | length | payload | sum: the low nibble of the
+ * length counts the payload bytes and sum is their 8 bit sum.
+ */
+
+static status_t BENCH_STATE(wait_sync)(BENCH_PARSER *const me,
+				       Event const *const e);
+static status_t BENCH_STATE(preamble)(BENCH_PARSER *const me,
+				      Event const *const e);
+static status_t BENCH_STATE(length)(BENCH_PARSER *const me,
+				    Event const *const e);
+static status_t BENCH_STATE(payload)(BENCH_PARSER *const me,
+				     Event const *const e);
+static status_t BENCH_STATE(check)(BENCH_PARSER *const me,
+				   Event const *const e);
+
+static status_t BENCH_STATE(wait_sync)(BENCH_PARSER *const me,
+				       Event const *const e)
+{
+	switch (e->sig) {
+	case SIGNAL_INIT:
+	case SIGNAL_ENTRY:
+	case SIGNAL_EXIT:
+		return STATE_HANDLED;
+	case SIGNAL_BYTE_RECEIVED:
+		if (me->byte == bench_sync[0]) {
+			return BENCH_TRANSIT(preamble);
+		}
+		return STATE_HANDLED;
+	default:
+		return STATE_IGNORED;
+	}
+}
+
+static status_t BENCH_STATE(preamble)(BENCH_PARSER *const me,
+				      Event const *const e)
+{
+	switch (e->sig) {
+	case SIGNAL_ENTRY:
+		me->index = 1U;
+		return STATE_HANDLED;
+	case SIGNAL_EXIT:
+		return STATE_HANDLED;
+	case SIGNAL_BYTE_RECEIVED:
+		if (me->byte == bench_sync[me->index]) {
+			if (++me->index == sizeof(bench_sync)) {
+				return BENCH_TRANSIT(length);
+			}
+			return STATE_HANDLED;
+		}
+		/* A5 may start the next sync word, re-entering restarts it */
+		if (me->byte == bench_sync[0]) {
+			return BENCH_TRANSIT(preamble);
+		}
+		return BENCH_TRANSIT(wait_sync);
+	default:
+		return STATE_IGNORED;
+	}
+}
+
+static status_t BENCH_STATE(length)(BENCH_PARSER *const me,
+				    Event const *const e)
+{
+	switch (e->sig) {
+	case SIGNAL_ENTRY:
+	case SIGNAL_EXIT:
+		return STATE_HANDLED;
+	case SIGNAL_BYTE_RECEIVED:
+		me->length = me->byte & 0x0FU;
+		me->sum = 0U;
+		if (me->length == 0U) {
+			return BENCH_TRANSIT(check);
+		}
+		return BENCH_TRANSIT(payload);
+	default:
+		return STATE_IGNORED;
+	}
+}
+
+static status_t BENCH_STATE(payload)(BENCH_PARSER *const me,
+				     Event const *const e)
+{
+	switch (e->sig) {
+	case SIGNAL_ENTRY:
+		me->count = 0U;
+		return STATE_HANDLED;
+	case SIGNAL_EXIT:
+		return STATE_HANDLED;
+	case SIGNAL_BYTE_RECEIVED:
+		me->sum = (uint8_t)(me->sum + me->byte);
+		if (++me->count == me->length) {
+			return BENCH_TRANSIT(check);
+		}
+		return STATE_HANDLED;
+	default:
+		return STATE_IGNORED;
+	}
+}
+
+static status_t BENCH_STATE(check)(BENCH_PARSER *const me,
+				   Event const *const e)
+{
+	switch (e->sig) {
+	case SIGNAL_ENTRY:
+	case SIGNAL_EXIT:
+		return STATE_HANDLED;
+	case SIGNAL_BYTE_RECEIVED:
+		if (me->byte == me->sum) {
+			me->frames++;
+		} else {
+			me->errors++;
+		}
+		return BENCH_TRANSIT(wait_sync);
+	default:
+		return STATE_IGNORED;
+	}
+}
@@ -0,0 +1,215 @@
+/*
+ * Host test of the SPSC ring buffer, both sides run from one thread.
+ * Build and run with:
+ *   cmake -S common/test -B build-test && cmake --build build-test &&
+ *   ctest --test-dir build-test
+ */
+#include "is_ringbuffer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define RING_SIZE 16U
+
+static int failures = 0;
+
+#define CHECK(cond_)                                                  \
+	do {                                                          \
+		if (!(cond_)) {                                       \
+			printf("%s:%d: %s\n", __FILE__, __LINE__, #cond_); \
+			failures++;                                   \
+		}                                                     \
+	} while (0)
+
+static ring_buffer_t rb;
+static uint8_t storage[RING_SIZE];
+
+static void ring_init(void)
+{
+	memset(storage, 0, sizeof(storage));
+	ring_buffer_setup(&rb, storage, RING_SIZE);
+}
+
+/* Moves both indices to start, so the next writes begin there */
+static void ring_move_to(const uint32_t start)
+{
+	uint8_t scratch[RING_SIZE];
+
+	ring_init();
+	CHECK(ring_buffer_write_bulk(&rb, scratch, start) == start);
+	CHECK(ring_buffer_read_bulk(&rb, scratch, start) == start);
+	CHECK(ring_buffer_empty(&rb));
+}
+
+static void test_empty(void)
+{
+	uint8_t byte;
+	const uint8_t *span;
+
+	ring_init();
+	CHECK(ring_buffer_empty(&rb));
+	CHECK(ring_buffer_count(&rb) == 0U);
+	CHECK(ring_buffer_free(&rb) == RING_SIZE - 1U);
+	CHECK(!ring_buffer_read(&rb, &byte));
+	CHECK(!ring_buffer_peek(&rb, 0U, &byte));
+	CHECK(ring_buffer_readable_span(&rb, &span) == 0U);
+}
+
+/* One slot stays free, a full ring never reads as empty */
+static void test_full(void)
+{
+	uint8_t data[RING_SIZE];
+	uint8_t *span;
+
+	for (uint32_t start = 0U; start < RING_SIZE; start++) {
+		ring_move_to(start);
+		for (uint32_t i = 0U; i < RING_SIZE - 1U; i++) {
+			CHECK(ring_buffer_write(&rb, (uint8_t)i));
+		}
+		CHECK(!ring_buffer_write(&rb, 0xAAU));
+		CHECK(!ring_buffer_empty(&rb));
+		CHECK(ring_buffer_count(&rb) == RING_SIZE - 1U);
+		CHECK(ring_buffer_free(&rb) == 0U);
+		CHECK(ring_buffer_writable_span(&rb, &span) == 0U);
+		CHECK(ring_buffer_read_bulk(&rb, data, sizeof(data)) ==
+		      RING_SIZE - 1U);
+		for (uint32_t i = 0U; i < RING_SIZE - 1U; i++) {
+			CHECK(data[i] == i);
+		}
+		CHECK(ring_buffer_empty(&rb));
+	}
+}
+
+static void test_wraparound(void)
+{
+	uint8_t byte;
+
+	ring_init();
+	for (uint32_t i = 0U; i < (3U * RING_SIZE) + 5U; i++) {
+		CHECK(ring_buffer_write(&rb, (uint8_t)i));
+		CHECK(ring_buffer_write(&rb, (uint8_t)(i + 100U)));
+		CHECK(ring_buffer_count(&rb) == 2U);
+		CHECK(ring_buffer_read(&rb, &byte) && (byte == (uint8_t)i));
+		CHECK(ring_buffer_read(&rb, &byte) &&
+		      (byte == (uint8_t)(i + 100U)));
+		CHECK(ring_buffer_empty(&rb));
+	}
+}
+
+/* Bulk copies split at the end of the storage */
+static void test_bulk_across_wrap(void)
+{
+	uint8_t in[RING_SIZE];
+	uint8_t out[RING_SIZE];
+
+	for (uint32_t i = 0U; i < RING_SIZE; i++) {
+		in[i] = (uint8_t)(0x40U + i);
+	}
+	for (uint32_t start = 0U; start < RING_SIZE; start++) {
+		ring_move_to(start);
+		CHECK(ring_buffer_write_bulk(&rb, in, 10U) == 10U);
+		/* Only what fits is taken */
+		CHECK(ring_buffer_write_bulk(&rb, &in[10], 6U) == 5U);
+		CHECK(ring_buffer_count(&rb) == RING_SIZE - 1U);
+		memset(out, 0, sizeof(out));
+		CHECK(ring_buffer_read_bulk(&rb, out, 7U) == 7U);
+		CHECK(ring_buffer_read_bulk(&rb, &out[7], sizeof(out)) == 8U);
+		CHECK(memcmp(in, out, RING_SIZE - 1U) == 0);
+		CHECK(ring_buffer_empty(&rb));
+	}
+}
+
+static void test_peek_span_commit(void)
+{
+	const uint8_t *span;
+	uint8_t *wspan;
+	uint8_t byte;
+
+	/* Writes 10 bytes from offset 12: 4 before the wrap, 6 after */
+	ring_move_to(12U);
+	CHECK(ring_buffer_writable_span(&rb, &wspan) == 4U);
+	CHECK(wspan == &storage[12]);
+	for (uint32_t i = 0U; i < 4U; i++) {
+		wspan[i] = (uint8_t)i;
+	}
+	ring_buffer_write_commit(&rb, 4U);
+	/* The reader sits at 12, so 11 slots are left before it */
+	CHECK(ring_buffer_writable_span(&rb, &wspan) == 11U);
+	CHECK(wspan == &storage[0]);
+	for (uint32_t i = 0U; i < 6U; i++) {
+		wspan[i] = (uint8_t)(4U + i);
+	}
+	ring_buffer_write_commit(&rb, 6U);
+	CHECK(ring_buffer_count(&rb) == 10U);
+
+	for (uint32_t i = 0U; i < 10U; i++) {
+		CHECK(ring_buffer_peek(&rb, i, &byte) && (byte == i));
+	}
+	CHECK(!ring_buffer_peek(&rb, 10U, &byte));
+
+	/* The span stops at the end of the storage, then goes on from 0 */
+	CHECK(ring_buffer_readable_span(&rb, &span) == 4U);
+	CHECK((span == &storage[12]) && (span[0] == 0U));
+	ring_buffer_read_commit(&rb, 3U);
+	CHECK(ring_buffer_count(&rb) == 7U);
+	CHECK(ring_buffer_peek(&rb, 0U, &byte) && (byte == 3U));
+	CHECK(ring_buffer_readable_span(&rb, &span) == 1U);
+	ring_buffer_read_commit(&rb, 1U);
+	CHECK(ring_buffer_readable_span(&rb, &span) == 6U);
+	CHECK((span == &storage[0]) && (span[0] == 4U));
+	ring_buffer_read_commit(&rb, 6U);
+	CHECK(ring_buffer_empty(&rb));
+}
+
+/* A circular DMA fills the storage itself and only reports its offset */
+static void test_write_index_set(void)
+{
+	uint8_t out[RING_SIZE];
+
+	ring_init();
+	for (uint32_t i = 0U; i < RING_SIZE; i++) {
+		storage[i] = (uint8_t)i;
+	}
+	ring_buffer_write_index_set(&rb, 5U);
+	CHECK(ring_buffer_count(&rb) == 5U);
+	CHECK(ring_buffer_read_bulk(&rb, out, 3U) == 3U);
+	CHECK((out[0] == 0U) && (out[2] == 2U));
+
+	/* The DMA end of transfer reports the storage size, which is 0 */
+	ring_buffer_write_index_set(&rb, RING_SIZE);
+	CHECK(ring_buffer_count(&rb) == RING_SIZE - 3U);
+	ring_buffer_write_index_set(&rb, RING_SIZE + 2U);
+	CHECK(ring_buffer_count(&rb) == RING_SIZE - 1U);
+	CHECK(ring_buffer_read_bulk(&rb, out, sizeof(out)) == RING_SIZE - 1U);
+	CHECK((out[0] == 3U) && (out[12] == 15U) && (out[13] == 0U) &&
+	      (out[14] == 1U));
+	CHECK(ring_buffer_empty(&rb));
+
+	/* Moving the index to where the reader is reads as empty, which is
+	 * why the caller has to catch a lapped reader itself */
+	ring_buffer_write_index_set(&rb, 2U);
+	CHECK(ring_buffer_empty(&rb));
+
+	ring_buffer_reset(&rb);
+	CHECK(ring_buffer_empty(&rb));
+	ring_buffer_write_index_set(&rb, 1U);
+	CHECK(ring_buffer_read_bulk(&rb, out, sizeof(out)) == 1U);
+	CHECK(out[0] == 0U);
+}
+
+int main(void)
+{
+	test_empty();
+	test_full();
+	test_wraparound();
+	test_bulk_across_wrap();
+	test_peek_span_commit();
+	test_write_index_set();
+
+	if (failures != 0) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("is_ringbuffer: all checks passed\n");
+	return 0;
+}
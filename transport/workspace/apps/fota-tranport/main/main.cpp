@@ -5,7 +5,9 @@
 #include "driver/uart.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include <atomic>
 #include <charconv>
+#include <cstring>
 #include <format>
 #include "fsm.hpp"
 #include "packet.hpp"`
@@ -13,7 +15,14 @@
 #define FOTA_UART UART_NUM_1
 #define PIN_TX 10
 #define PIN_RX 11
+// RTS/CTS towards the bootloader's PA0 (CTS) / PA1 (RTS), only with a
+// bootloader built with BOOTLOADER_UART_FLOW_CONTROL
+#define FOTA_FLOW_CONTROL 0
+#define PIN_RTS 12
+#define PIN_CTS 13
 #define BAUD_RATE 115200
+// Negotiated with B_CMD_SET_BAUDRATE once the bootloader answers
+#define FAST_BAUD_RATE 921600
 
 static const char *TAG = "UART_TEST";
 
@@ -21,6 +30,12 @@ using namespace std;
 static QueueHandle_t uart_queue;
 static QueueHandle_t packet_queue;
 
+// Responses come back in the version of the last request
+static std::atomic<uint8_t> rx_protocol_version{PROTOCOL_VERSION_1};
+
+static const uint8_t packet_frame_v1[] = {0xA5, 0xAA, 0xBB, 0xA5};
+static const uint8_t packet_frame_v2[] = {0xA5, 0xAA, 0xBB, 0xA6};
+
 void uartinit(void)
 {
 
@@ -28,17 +43,21 @@ void uartinit(void)
     const int uart_buffer_size = 256;
 
     uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .flow_ctrl = FOTA_FLOW_CONTROL ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+        // deassert RTS while the RX FIFO still has room for a few bytes
+        .rx_flow_ctrl_thresh = 100,
         .source_clk = UART_SCLK_DEFAULT,
     };
 
     ESP_ERROR_CHECK(uart_driver_install(FOTA_UART, uart_buffer_size, uart_buffer_size, 256, &uart_queue, 0));
     ESP_ERROR_CHECK(uart_param_config(FOTA_UART, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(FOTA_UART, PIN_TX, PIN_RX, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    ESP_ERROR_CHECK(uart_set_pin(FOTA_UART, PIN_TX, PIN_RX,
+                                 FOTA_FLOW_CONTROL ? PIN_RTS : UART_PIN_NO_CHANGE,
+                                 FOTA_FLOW_CONTROL ? PIN_CTS : UART_PIN_NO_CHANGE));
 
     ESP_ERROR_CHECK(gpio_set_pull_mode((gpio_num_t)PIN_RX, GPIO_PULLUP_ONLY));
     ESP_ERROR_CHECK(gpio_set_pull_mode((gpio_num_t)PIN_TX, GPIO_PULLUP_ONLY));
@@ -48,7 +67,7 @@ void uartinit(void)
 static void uart_task(void *arg)
 {
     fsm_state_t fsm_state = READ_ID;
-    uint8_t idx;
+    uint16_t idx;
     Packet *packet;
 
     while (true)
@@ -69,22 +88,38 @@ static void uart_task(void *arg)
                 break;
             }
             packet->id = byte;
+            packet->version = rx_protocol_version.load();
             fsm_state = READ_LENGTH;
             break;
         }
         case READ_LENGTH:
+        case READ_LENGTH_HIGH:
         {
             std::cout << "Reading Length\n";
-            if (byte > MAX_PAYLOAD_SIZE)
+            if (fsm_state == READ_LENGTH)
+            {
+                packet->length = byte;
+                if (packet->version == PROTOCOL_VERSION_2)
+                {
+                    fsm_state = READ_LENGTH_HIGH;
+                    break;
+                }
+            }
+            else
+            {
+                packet->length |= static_cast<uint16_t>(byte) << 8;
+            }
+
+            const uint16_t limit = (packet->version == PROTOCOL_VERSION_2) ? MAX_PAYLOAD_SIZE : MAX_PAYLOAD_SIZE_V1;
+            if (packet->length > limit)
             {
                 vPortFree(packet);
                 fsm_state = READ_ID;
                 break;
             }
 
-            packet->length = byte;
             idx = 0;
-            fsm_state = (byte == 0) ? READ_CRC : READ_PAYLOAD;
+            fsm_state = (packet->length == 0) ? READ_CRC : READ_PAYLOAD;
             break;
         }
         case READ_PAYLOAD:
@@ -142,18 +177,19 @@ static void uart_task(void *arg)
 
 static std::vector<uint8_t> serialize_packet(const Packet &pkt)
 {
+    const uint8_t *frame = (pkt.version == PROTOCOL_VERSION_2) ? packet_frame_v2 : packet_frame_v1;
+    uint8_t header[3];
+    const size_t header_size = pkt.header(header);
+
     std::vector<uint8_t> out;
-    out.reserve(2 + pkt.length + sizeof(uint32_t));
+    out.reserve(sizeof(packet_frame_v1) + header_size + pkt.length + sizeof(uint32_t));
 
-    // Header
-    out.push_back(pkt.id);
-    out.push_back(pkt.length);
+    // Frame + header
+    out.insert(out.end(), frame, frame + sizeof(packet_frame_v1));
+    out.insert(out.end(), header, header + header_size);
 
     // Payload
-    for (uint8_t i = 0; i < pkt.length; ++i)
-    {
-        out.push_back(pkt.payload[i]);
-    }
+    out.insert(out.end(), pkt.payload, pkt.payload + pkt.length);
 
     // CRC32 (little-endian, wire-safe)
     const uint32_t crc = pkt.crc32;
@@ -176,6 +212,7 @@ static void send_fota_command(const Packet_t &p)
     {
         return;
     }
+    rx_protocol_version.store(p.version);
 
     const int bytes_written = uart_write_bytes(
         FOTA_UART,
@@ -193,11 +230,90 @@ static void send_fota_command(const Packet_t &p)
     uart_wait_tx_done(FOTA_UART, pdMS_TO_TICKS(100));
 }
 
+static bool wait_for_ack(TickType_t timeout)
+{
+    Packet_t *rx_pkt = nullptr;
+    if (xQueueReceive(packet_queue, &rx_pkt, timeout) != pdTRUE || rx_pkt == nullptr)
+    {
+        return false;
+    }
+    const bool ack = rx_pkt->id == B_ACK;
+    vPortFree(rx_pkt);
+    return ack;
+}
+
+// ACK at the old rate, switch, confirm at the new rate; the bootloader drops
+// an unconfirmed rate after its trial window, so we fall back as well
+static bool negotiate_baud_rate(uint32_t baudrate)
+{
+    uint32_t old_baudrate = BAUD_RATE;
+    uart_get_baudrate(FOTA_UART, &old_baudrate);
+
+    CommandSetBaudrate cmd{baudrate};
+    Packet_t p;
+    cmd.cmd(p);
+    send_fota_command(p);
+    if (!wait_for_ack(pdMS_TO_TICKS(500)))
+    {
+        ESP_LOGW("FOTA", "Baud rate %lu rejected", (unsigned long)baudrate);
+        return false;
+    }
+
+    uart_set_baudrate(FOTA_UART, baudrate);
+    send_fota_command(p);
+    if (wait_for_ack(pdMS_TO_TICKS(300)))
+    {
+        ESP_LOGI("FOTA", "Link running at %lu", (unsigned long)baudrate);
+        return true;
+    }
+
+    ESP_LOGW("FOTA", "No confirmation at %lu, back to %lu", (unsigned long)baudrate, (unsigned long)old_baudrate);
+    uart_set_baudrate(FOTA_UART, old_baudrate);
+    vTaskDelay(pdMS_TO_TICKS(600));
+    uart_flush_input(FOTA_UART);
+    return false;
+}
+
+// Highest rate the bootloader reports for B_CMD_SET_BAUDRATE, capped at
+// FAST_BAUD_RATE; 0 when it does not support the switch
+static uint32_t query_fast_baud_rate(void)
+{
+    CommandGetCapabilities cmd{};
+    Packet_t p;
+    cmd.cmd(p);
+    send_fota_command(p);
+
+    Packet_t *rx_pkt = nullptr;
+    if (xQueueReceive(packet_queue, &rx_pkt, pdMS_TO_TICKS(500)) != pdTRUE || rx_pkt == nullptr)
+    {
+        return 0;
+    }
+    uint32_t max_baudrate = 0;
+    uint16_t commands = 0;
+    if (rx_pkt->id == B_ACK && rx_pkt->length >= CommandGetCapabilities::RESPONSE_LENGTH)
+    {
+        memcpy(&max_baudrate, &rx_pkt->payload[4], sizeof(max_baudrate));
+        memcpy(&commands, &rx_pkt->payload[8], sizeof(commands));
+    }
+    vPortFree(rx_pkt);
+
+    if (!(commands & (1U << (B_CMD_SET_BAUDRATE - B_CMD_RETRANSMIT))))
+    {
+        return 0;
+    }
+    return std::min<uint32_t>(max_baudrate, FAST_BAUD_RATE);
+}
+
 static void fota_task(void *arg)
 {
     uint16_t counter = 0;
 
     fota::FotaTransport *ft = (fota::FotaTransport *)arg;
+    const uint32_t fast_baud_rate = query_fast_baud_rate();
+    if (fast_baud_rate > BAUD_RATE)
+    {
+        negotiate_baud_rate(fast_baud_rate);
+    }
     Command *cmd = new CommandGetBootloaderVersion{};
     Packet_t p;
     cmd->cmd(p);
@@ -243,5 +359,6 @@ extern "C" void app_main(void)
     fota::FotaTransport ft{};
 
     xTaskCreate(uart_task, "uart_task", 2048, nullptr, 6, nullptr);
-    xTaskCreate(fota_task, "fota_task", 2048, &ft, 5, nullptr);
+    // fota_task keeps a Packet_t on its stack, sized for 2 KB payloads
+    xTaskCreate(fota_task, "fota_task", 2048 + sizeof(Packet_t), &ft, 5, nullptr);
 }
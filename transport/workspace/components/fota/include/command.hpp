@@ -40,6 +40,9 @@ typedef enum command_id
     B_CMD_GET_RDP_LVL,
     B_CMD_JMP_TO_ADDR,
     B_CMD_ERASE_FLASH,
+    B_CMD_SET_BAUDRATE,
+    B_CMD_GET_CAPABILITIES,
+    B_CMD_BATCH,
     B_CMD_MAX
 } command_id_t;
 
@@ -78,7 +81,7 @@ public:
     // std::optional<Packet> receive_response_packet(const std::vector<uint8_t> &raw_data);
 
 protected:
-    uint32_t calculate_stm32_crc(uint8_t id, uint8_t length, const std::vector<uint8_t> &payload);
+    uint32_t calculate_stm32_crc(uint8_t id, uint16_t length, uint8_t version, const std::vector<uint8_t> &payload);
     static constexpr uint32_t TIMEOUT_MS = 2000;
 };
 
@@ -106,4 +109,33 @@ public:
 private:
 };
 
+// Sent once at the current rate and once more at the new rate to confirm it
+class CommandSetBaudrate : public Command
+{
+public:
+    explicit CommandSetBaudrate(uint32_t baudrate);
+    virtual ~CommandSetBaudrate() = default;
+    void cmd(Packet &pkt);
+    command_id_t get_cmd_id() const;
+    CommandInfo get_info() const;
+    uint32_t get_baudrate() const;
+
+private:
+    uint32_t baudrate;
+};
+
+// Reply: [version][window][max payload LE16][max baudrate LE32]
+//        [command bitmap LE16, bit n = 0xB0 + n][sync flags][feature flags]
+class CommandGetCapabilities : public Command
+{
+public:
+    static constexpr uint16_t RESPONSE_LENGTH = 12;
+
+    CommandGetCapabilities() = default;
+    virtual ~CommandGetCapabilities() = default;
+    void cmd(Packet &pkt);
+    command_id_t get_cmd_id() const;
+    CommandInfo get_info() const;
+};
+
 #endif // INCLUDE_COMMAND_HPP
\ No newline at end of file
@@ -5,6 +5,7 @@ typedef enum
 {
     READ_ID,
     READ_LENGTH,
+    READ_LENGTH_HIGH,
     READ_PAYLOAD,
     READ_CRC,
 } fsm_state_t;
@@ -4,16 +4,25 @@
 #include <cstdint>
 #include <vector>
 
-#define MAX_PAYLOAD_SIZE 16
+// v1: A5 AA BB A5 | id | length (1 byte) | payload (<= 16) | crc32
+// v2: A5 AA BB A6 | id | length (2 bytes, LE) | payload (<= negotiated) | crc32
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+
+#define MAX_PAYLOAD_SIZE_V1 16
+#define MAX_PAYLOAD_SIZE 2048
 
 typedef struct Packet
 {
     uint8_t id;
-    uint8_t length;
+    uint16_t length;
+    uint8_t version;
     uint8_t payload[MAX_PAYLOAD_SIZE];
     uint32_t crc32;
     friend std::ostream &operator<<(std::ostream &os, const Packet &p);
     uint32_t calculate_packet_crc() const;
+    // id + length bytes as they go on the wire, returns the header size
+    size_t header(uint8_t (&out)[3]) const;
 
 } Packet_t;
 
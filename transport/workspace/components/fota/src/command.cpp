@@ -20,11 +20,13 @@ CommandInfo CommandRetransmit::get_info() const
     return CommandInfo{B_CMD_RETRANSMIT, "CommandRetransmit"};
 }
 
-uint32_t Command::calculate_stm32_crc(uint8_t id, uint8_t length, const std::vector<uint8_t> &payload)
+uint32_t Command::calculate_stm32_crc(uint8_t id, uint16_t length, uint8_t version, const std::vector<uint8_t> &payload)
 {
+    // v2 sends the length as two little-endian bytes
+    const uint8_t length_bytes[2] = {static_cast<uint8_t>(length & 0xFF), static_cast<uint8_t>(length >> 8)};
     uint32_t crc = 0xFFFFFFFF;
     crc = esp_rom_crc32_be(crc, &id, 1);
-    crc = esp_rom_crc32_be(crc, &length, 1);
+    crc = esp_rom_crc32_be(crc, length_bytes, (version == PROTOCOL_VERSION_2) ? 2 : 1);
 
     if (length > 0 && !payload.empty())
     {
@@ -56,6 +58,56 @@ Command::Command()
 void CommandGetBootloaderVersion::cmd(Packet &pkt)
 {
     pkt.id = B_CMD_GET_BOOTLOADER_VERSION;
+    pkt.version = PROTOCOL_VERSION_1;
+    pkt.length = 0;
+    pkt.crc32 = pkt.calculate_packet_crc();
+}
+
+CommandSetBaudrate::CommandSetBaudrate(uint32_t baudrate) : Command(), baudrate(baudrate)
+{
+}
+
+command_id_t CommandSetBaudrate::get_cmd_id() const
+{
+    return B_CMD_SET_BAUDRATE;
+}
+
+CommandInfo CommandSetBaudrate::get_info() const
+{
+    return CommandInfo(B_CMD_SET_BAUDRATE, "CommandSetBaudrate");
+}
+
+uint32_t CommandSetBaudrate::get_baudrate() const
+{
+    return baudrate;
+}
+
+void CommandSetBaudrate::cmd(Packet &pkt)
+{
+    pkt.id = B_CMD_SET_BAUDRATE;
+    pkt.version = PROTOCOL_VERSION_1;
+    pkt.length = sizeof(baudrate);
+    pkt.payload[0] = static_cast<uint8_t>(baudrate >> 0);
+    pkt.payload[1] = static_cast<uint8_t>(baudrate >> 8);
+    pkt.payload[2] = static_cast<uint8_t>(baudrate >> 16);
+    pkt.payload[3] = static_cast<uint8_t>(baudrate >> 24);
+    pkt.crc32 = pkt.calculate_packet_crc();
+}
+
+command_id_t CommandGetCapabilities::get_cmd_id() const
+{
+    return B_CMD_GET_CAPABILITIES;
+}
+
+CommandInfo CommandGetCapabilities::get_info() const
+{
+    return CommandInfo(B_CMD_GET_CAPABILITIES, "CommandGetCapabilities");
+}
+
+void CommandGetCapabilities::cmd(Packet &pkt)
+{
+    pkt.id = B_CMD_GET_CAPABILITIES;
+    pkt.version = PROTOCOL_VERSION_1;
     pkt.length = 0;
     pkt.crc32 = pkt.calculate_packet_crc();
 }
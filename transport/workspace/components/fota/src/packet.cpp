@@ -5,29 +5,29 @@
 #include "esp_rom_crc.h"
 
 #include "esp_rom_crc.h"
+#include <algorithm>
 #include <cstring>
 
-uint32_t Packet::calculate_packet_crc() const
+size_t Packet::header(uint8_t (&out)[3]) const
 {
-
-   // Build buffer: ID + LENGTH + payload
-   uint8_t buffer[2 + MAX_PAYLOAD_SIZE];
-   size_t idx = 0;
-   buffer[idx++] = id;
-   buffer[idx++] = length;
-   if (length > 0)
+   out[0] = id;
+   out[1] = static_cast<uint8_t>(length & 0xFF);
+   if (version == PROTOCOL_VERSION_2)
    {
-      std::memcpy(&buffer[idx], payload, length);
-      idx += length;
+      out[2] = static_cast<uint8_t>(length >> 8);
+      return 3;
    }
+   return 2;
+}
 
+static uint32_t crc32_stm32_accumulate(uint32_t crc, const uint8_t *data, size_t length)
+{
    // STM32 CRC-32 / MPEG-2 style
-   uint32_t crc = 0xFFFFFFFF;
    const uint32_t poly = 0x04C11DB7;
 
-   for (size_t i = 0; i < idx; ++i)
+   for (size_t i = 0; i < length; ++i)
    {
-      crc ^= static_cast<uint32_t>(buffer[i]) << 24; // MSB first
+      crc ^= static_cast<uint32_t>(data[i]) << 24; // MSB first
       for (int bit = 0; bit < 8; ++bit)
       {
          if (crc & 0x80000000)
@@ -36,7 +36,19 @@ uint32_t Packet::calculate_packet_crc() const
             crc <<= 1;
       }
    }
-   return crc; 
+   return crc;
+}
+
+uint32_t Packet::calculate_packet_crc() const
+{
+   // ID + LENGTH + payload, fed in place instead of copied into a buffer
+   uint8_t hdr[3];
+   uint32_t crc = crc32_stm32_accumulate(0xFFFFFFFF, hdr, header(hdr));
+   if (length > 0)
+   {
+      crc = crc32_stm32_accumulate(crc, payload, std::min<size_t>(length, MAX_PAYLOAD_SIZE));
+   }
+   return crc;
 }
 
 std::ostream &operator<<(std::ostream &os, const Packet &p)
@@ -49,6 +61,9 @@ std::ostream &operator<<(std::ostream &os, const Packet &p)
       << std::setw(2) << std::setfill('0')
       << static_cast<uint32_t>(p.id) << "\n";
 
+   os << std::dec << "VERSION: "
+      << static_cast<uint32_t>(p.version) << "\n";
+
    os << std::dec << "LENGTH: "
       << static_cast<uint32_t>(p.length) << "\n";
 